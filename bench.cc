@@ -0,0 +1,453 @@
+#include "utf8.hh"
+#include <chrono>
+#include <utility>
+
+
+
+/* Usage: bench [--quick] [--size bytes] [--json path] [corpus files...]
+ * Runs each public API over generated corpora and any given files, printing a table and writing the same results as json */
+
+
+static constexpr size_t DEFAULT_CORPUS_BYTES = 1 << 20;
+
+/* Minimum total time spent on each benchmark, over at least MIN_PASSES passes (The fastest pass is the one reported) */
+static constexpr double MIN_SECONDS = 0.25;
+static constexpr double QUICK_SECONDS = 0.02;
+static constexpr size_t MIN_PASSES = 3;
+
+/* Random accesses per pass for the indexed benchmarks, fewer for index_offset which scans from the start every time */
+static constexpr size_t RANDOM_ACCESSES = 1 << 16;
+static constexpr size_t SCAN_ACCESSES = 64;
+static constexpr size_t EDITS = 256;
+
+static char const* CORPUS_FILE = "bench_corpus.tmp";
+
+
+/* Allocator that counts the calls and bytes of every String under test */
+struct AllocationStats {
+  size_t calls;
+  size_t bytes;
+};
+
+static AllocationStats allocation_stats = { 0, 0 };
+
+static void* counting_allocate (void*, size_t size) {
+  ++ allocation_stats.calls;
+  allocation_stats.bytes += size;
+  return malloc(size);
+}
+
+static void* counting_reallocate (void*, void* ptr, size_t old_size, size_t new_size) {
+  ++ allocation_stats.calls;
+  if (new_size > old_size) allocation_stats.bytes += new_size - old_size;
+  return realloc(ptr, new_size);
+}
+
+static void counting_deallocate (void*, void* ptr, size_t) {
+  free(ptr);
+}
+
+static utf8::Allocator const counting_allocator = { NULL, counting_allocate, counting_reallocate, counting_deallocate };
+
+
+/* Deterministic xorshift so every run measures the same corpora */
+struct Random {
+  uint64_t state;
+
+  uint32_t next () {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t) (state >> 32);
+  }
+
+  uint32_t below (uint32_t n) {
+    return next() % n;
+  }
+
+  int32_t between (int32_t lo, int32_t hi) {
+    return lo + (int32_t) below((uint32_t) (hi - lo + 1));
+  }
+};
+
+
+enum class CorpusKind {
+  Ascii,
+  Latin1,
+  Arabic,
+  Cjk,
+  Emoji,
+  Malformed,
+};
+
+struct Corpus {
+  char const* name;
+  utf8::String text;
+
+  /* Whether the text is well formed utf8, the APIs that require it are skipped otherwise */
+  bool valid;
+
+  size_t char_length;
+};
+
+
+/* Pick the next grapheme of a generated corpus, with roughly word sized runs separated by spaces and the odd newline */
+static int32_t generate_char (CorpusKind kind, Random& random) {
+  uint32_t roll = random.below(100);
+
+  if (roll < 12) return roll == 0? '\n' : ' ';
+
+  switch (kind) {
+    case CorpusKind::Ascii: return roll < 20? random.between('0', '9') : random.between('a', 'z');
+    case CorpusKind::Latin1: return roll < 55? random.between('a', 'z') : random.between(0xC0, 0xFF);
+    case CorpusKind::Arabic: return roll < 90? random.between(0x0621, 0x064A) : random.between(0x064B, 0x0652);
+    case CorpusKind::Cjk:
+      if (roll < 70) return random.between(0x4E00, 0x9FA5);
+      if (roll < 90) return random.between(0x3041, 0x3096);
+      return roll < 95? 0x3001 : 0x3002;
+    case CorpusKind::Emoji:
+      if (roll < 40) return random.between('a', 'z');
+      if (roll < 85) return random.between(0x1F600, 0x1F64F);
+      if (roll < 92) return random.between(0x1F3FB, 0x1F3FF);
+      return roll < 96? 0x200D : 0x2764;
+    case CorpusKind::Malformed: return roll < 60? random.between(0xC0, 0xFF) : random.between(0x4E00, 0x9FA5);
+  }
+
+  return ' ';
+}
+
+/* Corrupt a Malformed corpus with stray continuations, cut off sequences, overlongs and bytes that never appear in utf8 */
+static void corrupt (utf8::String& text, Random& random) {
+  static uint8_t const BAD [] = { 0x80, 0xBF, 0xC0, 0xC1, 0xE4, 0xF0, 0xF5, 0xFF };
+
+  // the last bytes stay intact so the text ends on a whole sequence, which get_char requires
+  for (size_t i = 0; i + 8 < text.byte_length; i += 1 + random.below(64)) {
+    text.bytes[i] = BAD[random.below(sizeof(BAD))];
+  }
+
+  text.clear_caches();
+}
+
+static Corpus generate_corpus (char const* name, CorpusKind kind, size_t byte_length, uint64_t seed) {
+  Random random = { seed };
+  utf8::String text { &counting_allocator, byte_length + 8 };
+
+  while (text.byte_length < byte_length) text.insert(generate_char(kind, random));
+
+  if (kind == CorpusKind::Malformed) corrupt(text, random);
+
+  text.insert(" ok\n");
+
+  bool valid = utf8::validate(text.bytes, text.byte_length).is_valid();
+  size_t char_length = utf8::char_count(utf8::StringView { text });
+
+  return { name, std::move(text), valid, char_length };
+}
+
+static Corpus load_corpus (char const* file_name) {
+  utf8::String text = utf8::String::from_file(file_name, &counting_allocator);
+
+  // NUL bytes would end the ustr functions early, so a binary file is measured up to its first one
+  text.byte_length = utf8::byte_count(text.bytes);
+  text.clear_caches();
+
+  bool valid = utf8::validate(text.bytes, text.byte_length).is_valid();
+  size_t char_length = utf8::char_count(utf8::StringView { text });
+
+  return { file_name, std::move(text), valid, char_length };
+}
+
+
+/* One row of the results, bytes and chars are the work done by a single pass, ops its calls for the indexed benchmarks */
+struct Result {
+  char const* corpus;
+  char const* api;
+  size_t bytes;
+  size_t chars;
+  size_t ops;
+  size_t passes;
+  double seconds;
+  double allocations;
+  double allocated_bytes;
+};
+
+struct Results {
+  Result* rows;
+  size_t count;
+  size_t capacity;
+};
+
+static void push_result (Results& results, Result const& result) {
+  if (results.count == results.capacity) {
+    results.capacity = results.capacity == 0? 64 : results.capacity * 2;
+    results.rows = (Result*) realloc(results.rows, results.capacity * sizeof(Result));
+
+    if (results.rows == NULL) {
+      printf("Out of memory for benchmark results\n");
+      abort();
+    }
+  }
+
+  results.rows[results.count ++] = result;
+}
+
+/* Keeps the results of the measured calls alive so they aren't optimized away */
+static volatile uint64_t sink = 0;
+
+static double min_seconds = MIN_SECONDS;
+
+/* Time fn until it has run MIN_PASSES times and for min_seconds, keeping the fastest pass and the mean allocations per pass */
+template <typename Fn>
+static void measure (Results& results, Corpus const& corpus, char const* api, size_t bytes, size_t chars, size_t ops, Fn fn) {
+  using Clock = std::chrono::steady_clock;
+
+  sink = sink + fn();
+
+  allocation_stats = { 0, 0 };
+
+  double best = 1e30;
+  double total = 0;
+  size_t passes = 0;
+
+  while (passes < MIN_PASSES || total < min_seconds) {
+    auto start = Clock::now();
+    sink = sink + fn();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (elapsed < best) best = elapsed;
+    total += elapsed;
+    ++ passes;
+  }
+
+  push_result(results, {
+    corpus.name, api, bytes, chars, ops, passes, best,
+    (double) allocation_stats.calls / passes, (double) allocation_stats.bytes / passes
+  });
+
+  Result const& r = results.rows[results.count - 1];
+
+  printf("%-12s %-14s %10.3f GB/s %10.3f ns/char %12.1f ns/op %10.1f allocs %12.0f bytes\n",
+    r.corpus, r.api, r.bytes / r.seconds / 1e9, r.seconds * 1e9 / r.chars, r.seconds * 1e9 / r.ops, r.allocations, r.allocated_bytes);
+}
+
+
+static void bench_corpus (Results& results, Corpus& corpus) {
+  utf8::String& text = corpus.text;
+  utf8::StringView view { text };
+  size_t byte_length = text.byte_length;
+  size_t char_length = corpus.char_length;
+  Random random = { 0x9E3779B97F4A7C15ull ^ byte_length };
+
+  measure(results, corpus, "char_count", byte_length, char_length, 1, [&] () -> uint64_t {
+    return utf8::char_count(text.bytes, byte_length);
+  });
+
+  size_t scan_indices [SCAN_ACCESSES];
+  size_t scan_bytes = 0;
+  size_t scan_chars = 0;
+
+  for (size_t i = 0; i < SCAN_ACCESSES; ++ i) {
+    scan_indices[i] = random.below((uint32_t) char_length);
+    scan_bytes += utf8::index_offset(text.bytes, scan_indices[i]) - text.bytes;
+    scan_chars += scan_indices[i];
+  }
+
+  measure(results, corpus, "index_offset", scan_bytes, scan_chars, SCAN_ACCESSES, [&] () -> uint64_t {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < SCAN_ACCESSES; ++ i) sum += utf8::index_offset(text.bytes, scan_indices[i]) - text.bytes;
+    return sum;
+  });
+
+  size_t* access_indices = (size_t*) malloc(RANDOM_ACCESSES * sizeof(size_t));
+
+  if (access_indices == NULL) {
+    printf("Out of memory for benchmark indices\n");
+    abort();
+  }
+
+  for (size_t i = 0; i < RANDOM_ACCESSES; ++ i) access_indices[i] = random.below((uint32_t) char_length);
+
+  measure(results, corpus, "char_at", 0, RANDOM_ACCESSES, RANDOM_ACCESSES, [&] () -> uint64_t {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < RANDOM_ACCESSES; ++ i) sum += (uint32_t) text.char_at(access_indices[i]);
+    return sum;
+  });
+
+  measure(results, corpus, "column_count", byte_length, char_length, 1, [&] () -> uint64_t {
+    return utf8::column_count(view);
+  });
+
+  measure(results, corpus, "to_lowercase", byte_length, char_length, 1, [&] () -> uint64_t {
+    return text.to_lowercase().byte_length;
+  });
+
+  // utf8proc rejects malformed input outright
+  if (corpus.valid) {
+    measure(results, corpus, "casefold", byte_length, char_length, 1, [&] () -> uint64_t {
+      return text.casefold().byte_length;
+    });
+  }
+
+  text.to_file(CORPUS_FILE);
+
+  measure(results, corpus, "from_file", byte_length, char_length, 1, [&] () -> uint64_t {
+    return utf8::String::from_file(CORPUS_FILE, &counting_allocator).byte_length;
+  });
+
+  FILE* f = tmpfile();
+
+  if (f == NULL) {
+    printf("Error opening a temporary file\n");
+    abort();
+  }
+
+  measure(results, corpus, "put_char", byte_length, char_length, 1, [&] () -> uint64_t {
+    rewind(f);
+
+    uint8_t const* c = text.bytes;
+    uint8_t const* end = text.bytes + byte_length;
+
+    while (c < end) c += utf8::put_char(c, f);
+
+    fflush(f);
+    return (uint64_t) (c - text.bytes);
+  });
+
+  measure(results, corpus, "get_char", byte_length, char_length, 1, [&] () -> uint64_t {
+    rewind(f);
+
+    uint64_t sum = 0;
+    uint8_t c [4];
+    size_t size;
+
+    while ((size = utf8::get_char(c, f)) != 0) sum += size + utf8::to_int(c);
+
+    return sum;
+  });
+
+  fclose(f);
+  remove(CORPUS_FILE);
+
+  // each edit is undone straight away, so every pass starts from the same String
+  utf8::String edited { text };
+
+  for (size_t i = 0; i < EDITS; ++ i) access_indices[i] = random.below((uint32_t) char_length);
+
+  measure(results, corpus, "insert_remove", 0, EDITS, EDITS, [&] () -> uint64_t {
+    for (size_t i = 0; i < EDITS; ++ i) {
+      edited.insert_at(access_indices[i], u8"ñ😊x");
+      edited.remove(access_indices[i], 3);
+    }
+
+    return edited.byte_length;
+  });
+
+  free(access_indices);
+}
+
+
+static char const* simd_level_name (utf8::SimdLevel level) {
+  switch (level) {
+    case utf8::SimdLevel::Scalar: return "Scalar";
+    case utf8::SimdLevel::SSE2: return "SSE2";
+    case utf8::SimdLevel::AVX2: return "AVX2";
+    case utf8::SimdLevel::AVX512: return "AVX512";
+  }
+
+  return "Unknown";
+}
+
+/* Write a string as a json string, escaping what json requires (Corpus names can be file paths) */
+static void write_json_string (FILE* f, char const* str) {
+  fputc('"', f);
+
+  for (; *str; ++ str) {
+    if (*str == '"' || *str == '\\') fprintf(f, "\\%c", *str);
+    else if ((uint8_t) *str < 0x20) fprintf(f, "\\u%04x", *str);
+    else fputc(*str, f);
+  }
+
+  fputc('"', f);
+}
+
+static void write_json (char const* file_name, Results const& results, size_t corpus_bytes) {
+  FILE* f = fopen(file_name, "wb");
+
+  if (f == NULL) {
+    printf("Error writing file \"%s\"\n", file_name);
+    abort();
+  }
+
+  fprintf(f, "{\n  \"format\": 1,\n  \"simd\": \"%s\",\n  \"corpus_bytes\": %zu,\n  \"results\": [\n",
+    simd_level_name(utf8::simd_level()), corpus_bytes);
+
+  for (size_t i = 0; i < results.count; ++ i) {
+    Result const& r = results.rows[i];
+
+    fprintf(f, "    { \"corpus\": ");
+    write_json_string(f, r.corpus);
+    fprintf(f, ", \"api\": \"%s\", \"bytes\": %zu, \"chars\": %zu, \"ops\": %zu, \"passes\": %zu, \"seconds\": %.9g, ", r.api, r.bytes, r.chars, r.ops, r.passes, r.seconds);
+
+    // indexed benchmarks do no streaming work, so they have no throughput
+    if (r.bytes != 0) fprintf(f, "\"gb_per_s\": %.6g, ", r.bytes / r.seconds / 1e9);
+    else fprintf(f, "\"gb_per_s\": null, ");
+
+    fprintf(f, "\"ns_per_char\": %.6g, \"ns_per_op\": %.6g, \"allocations\": %.6g, \"allocated_bytes\": %.6g }%s\n",
+      r.seconds * 1e9 / r.chars, r.seconds * 1e9 / r.ops, r.allocations, r.allocated_bytes, i + 1 < results.count? "," : "");
+  }
+
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+
+int main (int argc, char** argv) {
+  size_t corpus_bytes = DEFAULT_CORPUS_BYTES;
+  char const* json_file = "bench.json";
+  char const** files = (char const**) malloc(argc * sizeof(char const*));
+  size_t file_count = 0;
+
+  for (int i = 1; i < argc; ++ i) {
+    if (strcmp(argv[i], "--quick") == 0) min_seconds = QUICK_SECONDS;
+    else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) corpus_bytes = strtoull(argv[++ i], NULL, 10);
+    else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) json_file = argv[++ i];
+    else files[file_count ++] = argv[i];
+  }
+
+  if (corpus_bytes < 64) corpus_bytes = 64;
+
+  Results results = { NULL, 0, 0 };
+
+  printf("Benchmarking %zu byte corpora (%s)\n\n", corpus_bytes, simd_level_name(utf8::simd_level()));
+
+  Corpus corpora [] = {
+    generate_corpus("ascii", CorpusKind::Ascii, corpus_bytes, 1),
+    generate_corpus("latin1", CorpusKind::Latin1, corpus_bytes, 2),
+    generate_corpus("arabic", CorpusKind::Arabic, corpus_bytes, 3),
+    generate_corpus("cjk", CorpusKind::Cjk, corpus_bytes, 4),
+    generate_corpus("emoji", CorpusKind::Emoji, corpus_bytes, 5),
+    generate_corpus("malformed", CorpusKind::Malformed, corpus_bytes, 6),
+  };
+
+  for (Corpus& corpus : corpora) bench_corpus(results, corpus);
+
+  for (size_t i = 0; i < file_count; ++ i) {
+    Corpus corpus = load_corpus(files[i]);
+
+    if (corpus.char_length == 0) {
+      printf("Skipping empty corpus \"%s\"\n", files[i]);
+      continue;
+    }
+
+    bench_corpus(results, corpus);
+  }
+
+  write_json(json_file, results, corpus_bytes);
+
+  printf("\nWrote %zu results to %s\n", results.count, json_file);
+
+  free(results.rows);
+  free(files);
+
+  return 0;
+}
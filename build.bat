@@ -9,10 +9,15 @@ if "%1"=="release" (
 )
 
 if %params%==0 (
-  echo Please provide release or debug as command line argument 1
+  echo Please provide release or debug as command line argument 1, and optionally bench as argument 2
 ) else (
   clang-cl %params% -c extern/utf8proc/utf8proc.c -Fobuild/utf8proc_%1 -DUTF8PROC_STATIC
   clang-cl %params% -c -std:c++17 utf8.cc -Fobuild/utf8_%1
     
   lib /OUT:.\build\utf8_%1.lib .\build\utf8proc_%1.obj .\build\utf8_%1.obj
+
+  if "%2"=="bench" (
+    clang-cl %params% -std:c++17 -EHsc bench.cc .\build\utf8_%1.lib -Fo.\build\bench_%1 -Fe.\build\bench_%1.exe
+    .\build\bench_%1.exe --json .\build\bench_%1.json test_in.txt
+  )
 )
\ No newline at end of file
@@ -12,9 +12,15 @@ fi
 
 if [ $params = 0 ]
 then
-  echo Please provide release or debug as command line argument 1
+  echo Please provide release or debug as command line argument 1, and optionally bench as argument 2
 else
   clang $params -c extern/utf8proc/utf8proc.c -obuild/utf8proc_$1.o -DUTF8PROC_STATIC
-  clang++ $params -c -std=c++17 utf8.cc -obuild/utf8_$1.o
+  clang++ $params -c -std=c++17 -pthread utf8.cc -obuild/utf8_$1.o
   ar rvs build/utf8_$1.a build/utf8proc_$1.o build/utf8_$1.o
+
+  if [ "$2" = "bench" ]
+  then
+    clang++ $params -std=c++17 -pthread bench.cc build/utf8_$1.a -obuild/bench_$1
+    ./build/bench_$1 --json build/bench_$1.json test_in.txt
+  fi
 fi
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "utf8.hh"
+#include <utility>
 
 
 
@@ -35,6 +36,32 @@ int main() {
   printf("  %zu\n", utf8::char_count(x));
 
 
+  utf8::SimdLevel detected = utf8::simd_level();
+  for (int level = 0; level <= (int) detected; ++ level) {
+    utf8::set_simd_level((utf8::SimdLevel) level);
+    printf("char_count at simd level %d: %zu (capped at 20 bytes: %zu)\n", level, utf8::char_count(unicode_text), utf8::char_count(unicode_text, 20));
+  }
+  utf8::set_simd_level(detected);
+
+
+  char const* malformed [] = { "ok 😊", "stray \x80", "cut \xE3\x81", "over \xC0\xAF", "half \xED\xA0\x80", "big \xF4\x90\x80\x80" };
+  for (char const* m : malformed) {
+    utf8::ValidationResult r = utf8::validate((uint8_t const*) m);
+    printf("validate '%s': %s at %zu\n", m, utf8::error_name(r.error), r.offset);
+  }
+
+
+  size_t utf32_count = utf8::utf32_length(unicode_text, size);
+  int32_t* utf32 = (int32_t*) malloc(utf32_count * sizeof(int32_t));
+  utf8::decode_to_utf32(unicode_text, size, utf32);
+  size_t reencoded_length = utf8::utf8_length(utf32, utf32_count);
+  uint8_t* reencoded = (uint8_t*) malloc(reencoded_length + 1);
+  reencoded[utf8::encode_from_utf32(utf32, utf32_count, reencoded)] = 0;
+  printf("utf32 round trip: %zu graphemes, %zu bytes, %s\n", utf32_count, reencoded_length, strcmp((char*) reencoded, (char*) unicode_text) == 0? "match" : "MISMATCH");
+  free(reencoded);
+  free(utf32);
+
+
   utf8::String string0 { "hello😊world" };
   string0.insert_at(0, "llama💩");
   string0.insert_at(6, "drama ");
@@ -42,6 +69,17 @@ int main() {
   string0.insert_fmt(" large literal %p\n", &string0);
   printf("Test string0: %s", (char*) string0);
 
+  utf8::String long_string;
+  for (int i = 0; i < 100; ++ i) long_string.insert_fmt("%d😊 ", i);
+  long_string.insert_at(150, "[inserted]");
+  long_string.remove(10, 5);
+  printf("Indexed long string: '%.*s' ... grapheme 300 is '", 13, long_string.str_at(295));
+  utf8::put_char(long_string[300], stdout);
+  printf("', index has %zu entries\n", long_string.char_index != NULL? long_string.char_index->count : 0);
+  long_string.build_char_index();
+  utf8::String const& shared_string = long_string;
+  printf("Built index has %zu entries, the end is byte %zu of %zu\n", shared_string.char_index->count, shared_string.byte_offset(shared_string.length()), shared_string.byte_length);
+
   utf8::String string1 { "BIG LETTERS ÀÈÌÒÙ ÁÉÍÓÚÝ" };
   utf8::String string2 { "lil letters àèìòù áéíóúý" };
 
@@ -54,12 +92,103 @@ int main() {
 
   printf("casefold:\n%s\n%s\n\n", (char*) string1.casefold(), (char*) string2.casefold());
 
+  utf8::String in_place { "Mixed Case ÀÈÌ àèì 😊 text" };
+  in_place.make_uppercase();
+  uint8_t case_buffer [16] = { 0 };
+  size_t case_length = utf8::to_lowercase(in_place.bytes, in_place.byte_length, case_buffer, sizeof(case_buffer));
+  printf("make_uppercase: '%s', lowercase into %zu bytes: '%.*s' (of %zu)\n\n", (char*) in_place, sizeof(case_buffer), (int) sizeof(case_buffer), (char*) case_buffer, case_length);
+
+  utf8::StringView fold_a { "Straße ÀÈÌ" };
+  utf8::StringView fold_b { "STRASSE àèì" };
+  printf("casefold_equal: %d, same hash: %d, compare to \"strasse\": %d\n\n", (int) utf8::casefold_equal(fold_a, fold_b),
+    (int) (utf8::casefold_hash(fold_a) == utf8::casefold_hash(fold_b)), utf8::casefold_compare(fold_a, utf8::StringView { "strasse" }));
+
+  utf8::StringView decomposed { "Cafe\u0301 \uFB01ne" };
+  utf8::String normal_storage;
+  utf8::StringView nfc = utf8::normalize(decomposed, utf8::NormalForm::NFC, normal_storage);
+  printf("NFC of '%.*s': '%.*s' (%zu -> %zu bytes, normalized before: %d, after: %d, NFKC: %d)\n\n", (int) decomposed.byte_length, (char const*) decomposed.bytes,
+    (int) nfc.byte_length, (char const*) nfc.bytes, decomposed.byte_length, nfc.byte_length, (int) utf8::is_normalized(decomposed, utf8::NormalForm::NFC),
+    (int) utf8::is_normalized(nfc, utf8::NormalForm::NFC), (int) utf8::is_normalized(nfc, utf8::NormalForm::NFKC));
+
+
+  utf8::String with_nul;
+  with_nul.insert((uint8_t const*) "ab\0cd", 5);
+  size_t cached_length = with_nul.length();
+  with_nul.clear_caches();
+  printf("NUL: %zu graphemes, %zu recounted\n", cached_length, with_nul.length());
+
+  utf8::String truncated;
+  truncated.insert((uint8_t const*) "\xE2", 1);
+  truncated.insert("ab");
+  cached_length = truncated.length();
+  truncated.clear_caches();
+  printf("Truncated lead: %zu graphemes, %zu recounted\n\n", cached_length, truncated.length());
+
+
+  utf8::String haystack { "llama 😊 drama 😊 llama" };
+  utf8::Match first = haystack.find("😊 ");
+  utf8::Match last = haystack.rfind("llama");
+  size_t replaced = haystack.replace_all("😊", ":)");
+  printf("find: byte %zu grapheme %zu, rfind: byte %zu grapheme %zu, %zu occurrences of \"ama\", replaced %zu: '%s' (%zu graphemes)\n",
+    first.byte_offset, first.char_index, last.byte_offset, last.char_index, haystack.count_occurrences("ama"), replaced, (char*) haystack, haystack.length());
+
+  utf8::String stray_lead { "x\xE2" "ab" };
+  stray_lead.length();
+  stray_lead.replace_all("\xE2", "");
+  stray_lead.insert_at(1, 'Z');
+  printf("Replaced a stray lead and inserted at 1: '%s' (%zu graphemes)\n\n", (char*) stray_lead, stray_lead.length());
+
+
+  utf8::String removed { "hello world" };
+  removed.remove(0, 6);
+  removed.insert_at(4, 'X');
+  printf("remove: '%s' (%zu graphemes, %zu counted)\n\n", (char*) removed, removed.length(), utf8::char_count(utf8::StringView { removed }));
+
+
+  utf8::StringView log_line { "  level=info\u3000host=llama\u00A0msg=drama  \r\nnext line\n" };
+  printf("split_whitespace:");
+  for (utf8::StringView field : utf8::split_whitespace(log_line)) printf(" [%.*s]", (int) field.byte_length, (char const*) field.bytes);
+  printf("\nsplit on '=':");
+  for (utf8::StringView piece : utf8::split(utf8::trim(log_line), "=")) printf(" [%.*s]", (int) piece.byte_length, (char const*) piece.bytes);
+  printf("\nlines:");
+  for (utf8::StringView l : utf8::lines(log_line)) printf(" [%.*s]", (int) l.byte_length, (char const*) l.bytes);
+  utf8::String messy { "\t  lots   of\u3000\u3000 space \n" };
+  messy.collapse_whitespace();
+  printf("\ncollapse_whitespace: '%s' (%zu graphemes)\n\n", (char*) messy, messy.length());
+
+
+  utf8::String large;
+  for (int i = 0; i < 1 << 17; ++ i) large.insert("llama 😊 drama 日本語 ");
+  utf8::StringView large_view { large };
+  printf("Parallel over %zu bytes: %zu graphemes (serial %zu), %zu columns (serial %zu), valid: %d\n\n", large.byte_length,
+    utf8::char_count_parallel(large_view, 4), utf8::char_count(large_view), utf8::column_count_parallel(large_view, 4), utf8::column_count(large_view),
+    (int) (utf8::validate_parallel(large.bytes, large.byte_length, 4).error == utf8::ValidationError::None));
+
+
+  constexpr utf8::Literal greeting { u8"Ñoño 日本語 ｈｉ" };
+  static_assert(greeting.length() == 11 && greeting.columns == 16, "Literal is counted at compile time");
+  constexpr utf8::Literal smiley { u8"llama 😊" };
+  printf("Literal: '%s' %zu graphemes, %zu columns, '%s' %zu graphemes, %zu columns (counted at run time: %d)\n\n",
+    greeting.bytes, greeting.length(), greeting.column_count(),
+    smiley.bytes, smiley.length(), smiley.column_count(), (int) (smiley.columns == utf8::Literal::UNKNOWN_COLUMNS));
+
+
+  utf8::reset_stats();
+  {
+    utf8::StatsTag tag { "prepend" };
+    utf8::String prepended;
+    for (int i = 0; i < 100; ++ i) prepended.insert_at(0, u8"ñ");
+  }
+  utf8::Stats stats = utf8::stats_snapshot();
+  printf("Stats (enabled: %d): %zu allocations, %zu reallocations, %zu moves of %zu bytes, %zu rescans\n\n",
+    (int) utf8::STATS_ENABLED, stats.allocations, stats.reallocations, stats.moves, stats.moved_bytes, stats.rescans);
+
 
   utf8::String string3 { u8"Ñoo"};
   string3.insert(u'ß');
   string3.insert(0x00df);
   string3.insert('s');
-  printf("string3: '%s'\n", (char*) string3);
+  printf("string3: '%s' (inline: %d)\n", (char*) string3, (int) string3.is_inline());
 
   int32_t mem;
   for (auto [ i, c ] : string3) {
@@ -68,6 +197,42 @@ int main() {
   }
 
 
+  utf8::Arena arena;
+  {
+    utf8::String arena_string { &arena.allocator };
+    for (size_t i = 0; i < 8; ++ i) arena_string.insert("drÀmÀ ");
+    utf8::String arena_upper = arena_string.to_uppercase();
+    printf("Arena string: '%s' (%zu graphemes, upper: '%s')\n", (char*) arena_string, arena_string.length(), (char*) arena_upper);
+  }
+  arena.reset();
+
+
+  long_string.share();
+  utf8::String shared_copy = long_string;
+  printf("Shared copy: %d (same bytes: %d)\n", (int) shared_copy.is_shared(), (int) (shared_copy.bytes == long_string.bytes));
+  shared_copy.insert("!");
+  utf8::String moved = std::move(shared_copy);
+  printf("After writing: %d, moved %zu graphemes, source left with %zu\n", (int) moved.is_shared(), moved.length(), shared_copy.length());
+
+
+  utf8::StringView view { unicode_text, size };
+  utf8::StringView middle = view.slice(11, 40);
+  utf8::String middle_copy { middle };
+  printf("StringView slice: '%.*s' (%zu graphemes, %zu columns, equal to its String copy: %d)\n",
+    (int) middle.byte_length, (char const*) middle.bytes, middle.length(), utf8::column_count(middle), (int) (middle == utf8::StringView { middle_copy }));
+
+
+  char const* string5_text = "Hello world 😊\nllama llama llama 💩\ndrÀmÀ drÀmÀ drÀmÀ\nÑooß";
+  utf8::Rope rope { string5_text };
+  rope.insert_at(6, "big ");
+  rope.remove(0, 6);
+  rope.insert_at(rope.line_start(2), (int32_t) U'👉');
+  utf8::String rope_string = rope.to_uppercase().to_string();
+  printf("Rope (%zu graphemes, %zu lines, line 2 starts with '", rope.length(), rope.newline_count() + 1);
+  utf8::put_char(rope[rope.line_start(2)], stdout);
+  printf("'):\n%s\n", (char*) rope_string);
+
+
   FILE* f;
   #ifdef _WIN32
     f = NULL;
@@ -89,14 +254,65 @@ int main() {
 
   fclose(f);
 
+  #ifdef _WIN32
+    f = NULL;
+    fopen_s(&f, "test_in.txt", "rb");
+  #else
+    f = fopen("test_in.txt", "rb");
+  #endif
+
+  utf8::Reader reader { f };
+  utf8::StringView line;
+  while (reader.read_line(line) == utf8::ReadStatus::Ok) {
+    printf("Read line from file: '%.*s' (%zu graphemes)\n", (int) line.byte_length, (char const*) line.bytes, line.length());
+  }
+
+  fclose(f);
+
+  f = tmpfile();
+  fwrite("a\x82\xE2" "b\xC0\x80", 1, 6, f);
+  rewind(f);
+
+  utf8::Reader char_reader { f };
+  int32_t read_c;
+  utf8::ReadStatus read_status;
+  while ((read_status = char_reader.read_char(read_c)) == utf8::ReadStatus::Ok || read_status == utf8::ReadStatus::Malformed) {
+    if (read_status == utf8::ReadStatus::Ok) printf("Read char U+%04X\n", read_c);
+    else printf("Read U+%04X for %s at byte %zu\n", read_c, utf8::error_name(char_reader.error.error), char_reader.error.offset);
+  }
+
+  fclose(f);
+
 
   utf8::String string4 = utf8::String::from_file("test_in.txt");
   printf("Read file to utf8::String: '%s'\n", (char*) string4);
 
+  utf8::MappedFile mapped = utf8::MappedFile::from_file("test_in.txt");
+  printf("Mapped test_in.txt: '%.*s' (mapped: %d, %zu graphemes)\n", (int) mapped.byte_length, (char const*) mapped.bytes, (int) mapped.is_mapped, mapped.view().length());
 
-  utf8::String string5 { "Hello world 😊\nllama llama llama 💩\ndrÀmÀ drÀmÀ drÀmÀ\nÑooß" };
+
+  utf8::String string5 { string5_text };
   string5.to_file("test_out.txt");
   printf("Wrote file to test_out.txt\n");
 
+  {
+    utf8::Writer writer { stdout };
+    writer.write("Writer: ");
+    for (auto [ i, c ] : string5) writer.put_char(c == '\n'? ' ' : c);
+    writer.put_char('\n');
+  }
+
   printf("Number of columns for 😊: %zu, for A: %zu\n", utf8::column_count((uint8_t const*) "😊"), utf8::column_count((int32_t)'A'));
+  printf("Number of columns for '日本語 ok': %zu, for 'é' with a combining accent: %zu\n", utf8::column_count((uint8_t const*) "日本語 ok"), utf8::column_count((uint8_t const*) "e\u0301"));
+
+  utf8::StringView wide { "Wrapping 日本語 text with 😊 to twelve columns" };
+  utf8::StringView cut = utf8::truncate_columns(wide, 13);
+  printf("Truncated to 13 columns: '%.*s' (column 11 is grapheme %zu)\n", (int) cut.byte_length, (char const*) cut.bytes, utf8::column_position(wide, 11).char_index);
+  for (utf8::StringView wrapped : utf8::wrap_columns(wide, 12)) printf("| %-*.*s |\n", (int) (wrapped.byte_length + 12 - utf8::column_count(wrapped)), (int) wrapped.byte_length, (char const*) wrapped.bytes);
+
+  utf8::StringView composed { "e\u0301 🇯🇵 👨\u200D👩\u200D👧 ok" };
+  utf8::ClusterIndex cluster_cache;
+  printf("Clusters of '%.*s' (%zu graphemes, %zu clusters):", (int) composed.byte_length, (char const*) composed.bytes, composed.length(), utf8::cluster_count(composed));
+  for (utf8::StringView cluster : utf8::clusters(composed)) printf(" [%.*s]", (int) cluster.byte_length, (char const*) cluster.bytes);
+  printf("\nCluster 4 starts at byte %zu, the one before byte 20 at %zu\n", utf8::cluster_offset(composed, 4, &cluster_cache), utf8::cluster_start(composed, 19, &cluster_cache));
 }
\ No newline at end of file
@@ -1,117 +1,437 @@
 #include "utf8.hh"
 
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <thread>
+
 extern "C" {
   int32_t  utf8proc_toupper (int32_t c);
   int32_t  utf8proc_tolower (int32_t c);
   int utf8proc_charwidth (int32_t c);
   uint8_t* utf8proc_NFKC_Casefold (uint8_t const* str);
+  ptrdiff_t utf8proc_decompose_char (int32_t c, int32_t* dst, ptrdiff_t bufsize, int options, int* last_boundclass);
+
+  /* Leading fields of utf8proc_property_t, which are the only ones read here */
+  struct utf8proc_property_head {
+    int16_t category;
+    int16_t combining_class;
+  };
+
+  utf8proc_property_head const* utf8proc_get_property (int32_t c);
+  bool utf8proc_grapheme_break_stateful (int32_t c1, int32_t c2, int32_t* state);
+  ptrdiff_t utf8proc_decompose (uint8_t const* str, ptrdiff_t strlen, int32_t* buffer, ptrdiff_t bufsize, int options);
+  ptrdiff_t utf8proc_normalize_utf32 (int32_t* buffer, ptrdiff_t length, int options);
 }
 
 #ifdef _WIN32
+  #include <io.h>
+  #include <sys/types.h>
+  #include <sys/stat.h>
+
   namespace Windows {
     extern "C" {
       int __declspec(dllimport) IsValidCodePage (unsigned int);
       int __declspec(dllimport) SetConsoleCP (unsigned int);
       int __declspec(dllimport) SetConsoleOutputCP (unsigned int);
+      void* __declspec(dllimport) CreateFileMappingA (void*, void*, unsigned long, unsigned long, unsigned long, char const*);
+      void* __declspec(dllimport) MapViewOfFile (void*, unsigned long, unsigned long, unsigned long, size_t);
+      int __declspec(dllimport) UnmapViewOfFile (void const*);
+      int __declspec(dllimport) CloseHandle (void*);
     }
 
     static constexpr
     unsigned int UTF8_FLAG = 65001;
+
+    static constexpr
+    unsigned long PAGE_READONLY = 0x02;
+
+    static constexpr
+    unsigned long FILE_MAP_READ = 0x04;
   }
+#else
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/uio.h>
+  #include <errno.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #define UTF8_X86 1
+
+  #include <immintrin.h>
+
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #else
+    #include <cpuid.h>
+  #endif
+#endif
+
+// MSVC proper compiles any intrinsic anywhere, gcc and clang need per function opt in
+#if defined(__GNUC__) || defined(__clang__)
+  #define UTF8_TARGET(features) __attribute__((target(features)))
+#else
+  #define UTF8_TARGET(features)
 #endif
 
 
 namespace utf8 {
-  extern
-  void setup_console () {
-    #ifdef _WIN32
-      if (Windows::IsValidCodePage(Windows::UTF8_FLAG)) {
-        if (!Windows::SetConsoleCP(Windows::UTF8_FLAG)) goto err;
-        if (!Windows::SetConsoleOutputCP(Windows::UTF8_FLAG)) goto err;
-        return;
-      }
+  static inline
+  unsigned __popcount (uint64_t x) {
+    #if defined(__GNUC__) || defined(__clang__)
+      return __builtin_popcountll(x);
+    #else
+      x = x - ((x >> 1) & 0x5555555555555555ull);
+      x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+      x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+      return (unsigned) ((x * 0x0101010101010101ull) >> 56);
+    #endif
+  }
 
-      err: {
-        printf("A UTF-8 compatible terminal is required\n");
-        abort();
-      }
+  /* Byte size of the sequence started by a lead byte, matching char_size (Stray continuation and invalid bytes count as 1) */
+  static inline
+  uint8_t __lead_size (uint8_t c) {
+    if (c < 0xC0) return 1;
+    if (c < 0xE0) return 2;
+    if (c < 0xF0) return 3;
+    if (c < 0xF8) return 4;
+    return 1;
+  }
+
+
+  #ifdef UTF8_X86
+    static
+    void __cpu_query (uint32_t leaf, uint32_t sub_leaf, uint32_t regs [4]) {
+      #ifdef _MSC_VER
+        __cpuidex((int*) regs, (int) leaf, (int) sub_leaf);
+      #else
+        __cpuid_count(leaf, sub_leaf, regs[0], regs[1], regs[2], regs[3]);
+      #endif
+    }
+
+    static
+    uint64_t __os_saved_state () {
+      #ifdef _MSC_VER
+        return _xgetbv(0);
+      #else
+        uint32_t lo, hi;
+        __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return ((uint64_t) hi << 32) | lo;
+      #endif
+    }
+  #endif
+
+  static
+  SimdLevel __detect_simd_level () {
+    #ifdef UTF8_X86
+      uint32_t regs [4];
+
+      __cpu_query(0, 0, regs);
+      uint32_t max_leaf = regs[0];
+      if (max_leaf < 1) return SimdLevel::Scalar;
+
+      __cpu_query(1, 0, regs);
+      if (!(regs[3] & (1u << 26))) return SimdLevel::Scalar;
+
+      bool os_avx = (regs[2] & (1u << 27)) && (regs[2] & (1u << 28))
+                 && (__os_saved_state() & 0x06) == 0x06;
+
+      if (!os_avx || max_leaf < 7) return SimdLevel::SSE2;
+
+      __cpu_query(7, 0, regs);
+      if (!(regs[1] & (1u << 5))) return SimdLevel::SSE2;
+
+      bool avx512 = (regs[1] & (1u << 16)) && (regs[1] & (1u << 30))
+                 && (__os_saved_state() & 0xE6) == 0xE6;
+
+      return avx512? SimdLevel::AVX512 : SimdLevel::AVX2;
+    #else
+      return SimdLevel::Scalar;
     #endif
   }
 
-  extern
-  uint8_t char_size (uint8_t const* c) {
-    const bool vals[] = {
-      (*c & 0b10000000) == 0b00000000,
-      (*c & 0b11100000) == 0b11000000,
-      (*c & 0b11110000) == 0b11100000,
-      (*c & 0b11111000) == 0b11110000,
-    };
+  static
+  SimdLevel __max_simd_level () {
+    static SimdLevel const level = __detect_simd_level();
+    return level;
+  }
 
-    uint8_t out = 0;
+  /* The level the kernels dispatch on (Atomic, as set_simd_level can run while the parallel workers are reading it) */
+  static
+  std::atomic<SimdLevel>& __simd_level_state () {
+    static std::atomic<SimdLevel> level { __max_simd_level() };
+    return level;
+  }
 
-    for (uint8_t i = 0; i < 4; ++i)
-      vals[i] && (out = i);
+  static inline
+  SimdLevel __active_simd_level () {
+    return __simd_level_state().load(std::memory_order_relaxed);
+  }
 
-    return out + 1;
+  extern
+  SimdLevel simd_level () {
+    return __active_simd_level();
   }
 
   extern
-  uint8_t char_size (int32_t c) {
-    const bool vals[] = {
-      c < 128,
-      c >= 128 && c < 2048,
-      c >= 2048 && c < 65536,
-      c >= 65536 && c < 1114112,
-    };
+  void set_simd_level (SimdLevel level) {
+    __simd_level_state().store(level < __max_simd_level()? level : __max_simd_level(), std::memory_order_relaxed);
+  }
 
-    uint8_t out = 0;
 
-    for (uint8_t i = 0; i < 4; ++i)
-      if (vals[i]) out = i;
+  /* Per byte classification of a block of bytes, bit i describes byte i */
+  struct __BlockMasks {
+    uint64_t zero;
+    uint64_t cont;
+    uint64_t lead2;
+    uint64_t lead3;
+    uint64_t lead4;
+    uint64_t bad;
+  };
 
-    if (c >= 1114112 or c < 0) {
-      printf("Char code %d is out of utf8 range (Must be integer 0 - 1114112)\n", c);
-      abort();
-    }
+  /* Count the code points in a classified block, as long as walking it one char_size at a time would land on exactly its lead bytes.
+   * pending carries the continuation bytes owed by sequences started in the previous block */
+  static inline
+  bool __count_block (__BlockMasks const& m, unsigned width, uint64_t& pending, size_t& count) {
+    uint64_t full = width == 64? ~(uint64_t) 0 : ((uint64_t) 1 << width) - 1;
+    uint64_t expected = ((m.lead2 << 1) | (m.lead3 << 2) | (m.lead4 << 3) | pending) & full;
 
-    return out + 1;
+    if (m.zero | m.bad | (expected ^ m.cont)) return false;
+
+    count += width - __popcount(m.cont);
+    pending = (m.lead2 >> (width - 1)) | (m.lead3 >> (width - 2)) | (m.lead4 >> (width - 3));
+
+    return true;
   }
 
-  extern
-  int32_t to_int (uint8_t const* c) {
-    int32_t out = *c;
+  #ifdef UTF8_X86
+    /* The SIMD kernels take a pointer aligned to their width and stop at the first block they can't handle
+     * (Or hold a NUL, if asked to stop there), returning the byte offset a char_size walk would have reached (Which can be inside the next block) */
+
+    static
+    size_t __char_count_sse2 (uint8_t const* ustr, size_t limit, bool stop_at_nul, size_t& count) {
+      __m128i const zero = _mm_setzero_si128();
+      uint64_t pending = 0;
+      size_t offset = 0;
+
+      for (; offset + 16 <= limit; offset += 16) {
+        __m128i v = _mm_load_si128((__m128i const*) (ustr + offset));
+
+        __BlockMasks m;
+        uint32_t high = (uint32_t) _mm_movemask_epi8(v);
+        m.zero = stop_at_nul? (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) : 0;
+
+        if ((high | m.zero | pending) == 0) {
+          count += 16;
+          continue;
+        }
+
+        // signed compares, so everything but the continuation test is limited to the high bit set bytes
+        m.cont  = (uint32_t) _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-64)));
+        m.lead2 = (uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-65))) & high;
+        m.lead3 = (uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-33))) & high;
+        m.lead4 = (uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-17))) & high;
+        m.bad   = (uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-9))) & high;
+
+        if (!__count_block(m, 16, pending, count)) break;
+      }
+
+      return offset + __popcount(pending);
+    }
 
-    switch (char_size(c)) {
-      case 1: return out;
-      case 2: return ((out & 31) << 6) | (c[1] & 63);
-      case 3: return ((out & 15) << 12) | ((c[1] & 63) << 6) | (c[2] & 63);
-      case 4: return ((out & 7) << 18) | ((c[1] & 63) << 12) | ((c[2] & 63) << 6) | (c[3] & 63);
+    UTF8_TARGET("avx2,popcnt")
+    static
+    size_t __char_count_avx2 (uint8_t const* ustr, size_t limit, bool stop_at_nul, size_t& count) {
+      __m256i const zero = _mm256_setzero_si256();
+      uint64_t pending = 0;
+      size_t offset = 0;
+
+      for (; offset + 32 <= limit; offset += 32) {
+        __m256i v = _mm256_load_si256((__m256i const*) (ustr + offset));
+
+        __BlockMasks m;
+        uint32_t high = (uint32_t) _mm256_movemask_epi8(v);
+        m.zero = stop_at_nul? (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) : 0;
+
+        if ((high | m.zero | pending) == 0) {
+          count += 32;
+          continue;
+        }
+
+        m.cont  = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v));
+        m.lead2 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-65))) & high;
+        m.lead3 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-33))) & high;
+        m.lead4 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-17))) & high;
+        m.bad   = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-9))) & high;
+
+        if (!__count_block(m, 32, pending, count)) break;
+      }
+
+      return offset + __popcount(pending);
+    }
+
+    UTF8_TARGET("avx512f,avx512bw,popcnt")
+    static
+    size_t __char_count_avx512 (uint8_t const* ustr, size_t limit, bool stop_at_nul, size_t& count) {
+      uint64_t pending = 0;
+      size_t offset = 0;
+
+      for (; offset + 64 <= limit; offset += 64) {
+        __m512i v = _mm512_load_si512((void const*) (ustr + offset));
+
+        __BlockMasks m;
+        m.zero = stop_at_nul? _mm512_testn_epi8_mask(v, v) : 0;
+
+        if ((_mm512_movepi8_mask(v) | m.zero | pending) == 0) {
+          count += 64;
+          continue;
+        }
+
+        m.cont  = _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8((char) 0xC0)) & _mm512_movepi8_mask(v);
+        m.lead2 = _mm512_cmpge_epu8_mask(v, _mm512_set1_epi8((char) 0xC0));
+        m.lead3 = _mm512_cmpge_epu8_mask(v, _mm512_set1_epi8((char) 0xE0));
+        m.lead4 = _mm512_cmpge_epu8_mask(v, _mm512_set1_epi8((char) 0xF0));
+        m.bad   = _mm512_cmpge_epu8_mask(v, _mm512_set1_epi8((char) 0xF8));
+
+        if (!__count_block(m, 64, pending, count)) break;
+      }
+
+      return offset + __popcount(pending);
+    }
+
+
+    /* The ASCII kernels take a pointer aligned to their width and return how many bytes of whole blocks were non-NUL ASCII,
+     * adding the number of printable (Non control) bytes among them to printable */
+
+    static
+    size_t __ascii_blocks_sse2 (uint8_t const* ustr, size_t limit, size_t& printable) {
+      __m128i const zero = _mm_setzero_si128();
+      size_t offset = 0;
+
+      for (; offset + 16 <= limit; offset += 16) {
+        __m128i v = _mm_load_si128((__m128i const*) (ustr + offset));
+
+        if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)))) break;
+
+        __m128i control = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+        printable += 16 - __popcount((uint32_t) _mm_movemask_epi8(control));
+      }
+
+      return offset;
+    }
+
+    UTF8_TARGET("avx2,popcnt")
+    static
+    size_t __ascii_blocks_avx2 (uint8_t const* ustr, size_t limit, size_t& printable) {
+      __m256i const zero = _mm256_setzero_si256();
+      size_t offset = 0;
+
+      for (; offset + 32 <= limit; offset += 32) {
+        __m256i v = _mm256_load_si256((__m256i const*) (ustr + offset));
+
+        if (_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero)))) break;
+
+        __m256i control = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+        printable += 32 - __popcount((uint32_t) _mm256_movemask_epi8(control));
+      }
+
+      return offset;
     }
 
-    return 0;
+    UTF8_TARGET("avx512f,avx512bw,popcnt")
+    static
+    size_t __ascii_blocks_avx512 (uint8_t const* ustr, size_t limit, size_t& printable) {
+      size_t offset = 0;
+
+      for (; offset + 64 <= limit; offset += 64) {
+        __m512i v = _mm512_load_si512((void const*) (ustr + offset));
+
+        if (_mm512_movepi8_mask(v) | _mm512_testn_epi8_mask(v, v)) break;
+
+        uint64_t control = _mm512_cmplt_epi8_mask(v, _mm512_set1_epi8(0x20)) | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(0x7F));
+        printable += 64 - __popcount(control);
+      }
+
+      return offset;
+    }
+  #endif
+
+  /* Widest block any kernel reads, scalar code walks up to a multiple of this before handing over */
+  static constexpr
+  size_t __SIMD_ALIGNMENT = 64;
+
+  static inline
+  bool __simd_aligned (uint8_t const* p) {
+    return ((uintptr_t) p & (__SIMD_ALIGNMENT - 1)) == 0;
   }
 
-  extern
-  size_t encode (int32_t c, uint8_t* bytes) {
-    size_t length = char_size(c);
+  static
+  size_t __char_count_blocks (uint8_t const* ustr, size_t limit, bool stop_at_nul, size_t& count) {
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512: return __char_count_avx512(ustr, limit, stop_at_nul, count);
+        case SimdLevel::AVX2: return __char_count_avx2(ustr, limit, stop_at_nul, count);
+        case SimdLevel::SSE2: return __char_count_sse2(ustr, limit, stop_at_nul, count);
+      #endif
+      default: return 0;
+    }
+  }
 
-    if (length == 1) {
-      bytes[0] = c;
-    } else if (length == 2) {
-      bytes[0] = 192 + (c >> 6);
-      bytes[1] = 128 + (c & 63);
-    } else if (length == 3) {
-      bytes[0] = 224 + (c >> 12);
-      bytes[1] = 128 + ((c >> 6) & 63);
-      bytes[2] = 128 + (c & 63);
-    } else if (length == 4) {
-      bytes[0] = 240 + (c >> 18);
-      bytes[1] = 128 + ((c >> 12) & 63);
-      bytes[2] = 128 + ((c >> 6) & 63);
-      bytes[3] = 128 + (c & 63);
+  static
+  size_t __ascii_blocks (uint8_t const* ustr, size_t limit, size_t& printable) {
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512: return __ascii_blocks_avx512(ustr, limit, printable);
+        case SimdLevel::AVX2: return __ascii_blocks_avx2(ustr, limit, printable);
+        case SimdLevel::SSE2: return __ascii_blocks_sse2(ustr, limit, printable);
+      #endif
+      default: return 0;
     }
+  }
 
-    return length;
+  /* Get the length of the run of non-NUL ASCII bytes at the start of a ustr (Capped at limit),
+   * adding the number of printable (Non control) bytes among them to printable */
+  static
+  size_t __ascii_run (uint8_t const* ustr, size_t limit, size_t& printable) {
+    size_t offset = 0;
+
+    auto scalar = [&] (size_t end) {
+      for (; offset < end; ++ offset) {
+        uint8_t c = ustr[offset];
+        if (c == 0 || c >= 0x80) return false;
+        printable += c >= 0x20 && c != 0x7F;
+      }
+
+      return true;
+    };
+
+    size_t head = ((uintptr_t) 0 - (uintptr_t) ustr) & (__SIMD_ALIGNMENT - 1);
+
+    if (!scalar(head < limit? head : limit) || offset == limit) return offset;
+
+    offset += __ascii_blocks(ustr + offset, limit - offset, printable);
+
+    scalar(limit);
+
+    return offset;
+  }
+
+
+  extern
+  void setup_console () {
+    #ifdef _WIN32
+      if (Windows::IsValidCodePage(Windows::UTF8_FLAG)) {
+        if (!Windows::SetConsoleCP(Windows::UTF8_FLAG)) goto err;
+        if (!Windows::SetConsoleOutputCP(Windows::UTF8_FLAG)) goto err;
+        return;
+      }
+
+      err: {
+        printf("A UTF-8 compatible terminal is required\n");
+        abort();
+      }
+    #endif
   }
 
   extern
@@ -151,18 +471,65 @@ namespace utf8 {
     return to_int((uint8_t*) &mem);
   }
 
-  extern
-  size_t char_count (uint8_t const* ustr, size_t max_byte_length) {
+  /* Bytes __char_count searches for a NUL at a time before counting them (A multiple of __SIMD_ALIGNMENT that fits in L1) */
+  static constexpr
+  size_t __NUL_WINDOW = 16 * 1024;
+
+  /* Count the steps of a char_size walk over a segment, optionally ending early at a NUL */
+  static
+  size_t __char_count (uint8_t const* ustr, size_t max_byte_length, bool stop_at_nul) {
     size_t i = 0;
     size_t byte_offset = 0;
+    size_t searched = 0; // end of the bytes known to hold no NUL
+
+    auto at_end = [&] () {
+      return byte_offset >= max_byte_length || (stop_at_nul && ustr[byte_offset] == '\0');
+    };
+
+    for (;;) {
+      while (!__simd_aligned(ustr + byte_offset)) {
+        if (at_end()) return i;
+        ++ i;
+        byte_offset += __lead_size(ustr[byte_offset]);
+      }
+
+      if (at_end()) return i;
+
+      // the block loads would otherwise run on past the terminator of a ustr with no real limit, so the kernels only get bytes
+      // already searched for a NUL, a window at a time so they are still in cache (And again after a truncated lead steps over one)
+      size_t limit = max_byte_length;
+
+      if (stop_at_nul) {
+        if (searched <= byte_offset) {
+          size_t window = max_byte_length - byte_offset < __NUL_WINDOW? max_byte_length - byte_offset : __NUL_WINDOW;
+          uint8_t const* nul = (uint8_t const*) memchr(ustr + byte_offset, 0, window);
+          searched = nul != NULL? (size_t) (nul - ustr) : byte_offset + window;
+        }
+
+        limit = searched;
+      }
+
+      size_t consumed = __char_count_blocks(ustr + byte_offset, limit - byte_offset, stop_at_nul, i);
+
+      // the kernels refuse blocks a char_size walk wouldn't step through lead byte by lead byte,
+      // so make progress on those one character at a time before trying again at the next alignment
+      if (consumed == 0) {
+        size_t block_end = byte_offset + __SIMD_ALIGNMENT;
 
-    while (ustr[byte_offset] != '\0'
-    && byte_offset < max_byte_length) {
-      ++ i;
-      byte_offset += char_size(ustr + byte_offset);
+        while (byte_offset < block_end) {
+          if (at_end()) return i;
+          ++ i;
+          byte_offset += __lead_size(ustr[byte_offset]);
+        }
+      }
+
+      byte_offset += consumed;
     }
+  }
 
-    return i;
+  extern
+  size_t char_count (uint8_t const* ustr, size_t max_byte_length) {
+    return __char_count(ustr, max_byte_length, true);
   }
 
   template <typename T>
@@ -182,17 +549,17 @@ namespace utf8 {
     return o;
   }
 
-  inline extern
+  extern
   uint8_t* index_offset (uint8_t* ustr, size_t index) {
     return __char_iterate(ustr, index);
   }
 
-  inline extern
+  extern
   uint8_t const* index_offset (uint8_t const* ustr, size_t index) {
     return __char_iterate(ustr, index);
   }
 
-  inline extern
+  extern
   size_t byte_offset (uint8_t const* ustr, size_t index) {
     return (size_t) index_offset(ustr, index) - (size_t) ustr;
   }
@@ -203,400 +570,4752 @@ namespace utf8 {
   }
 
 
-  inline extern
-  bool is_whitespace (int32_t c) {
-    return (c >= 0x0009 && c <= 0x000D)
-        || c == 0x0020
-        || c == 0x0085
-        || c == 0x00A0
-        || c == 0x1680
-        || (c >= 0x2000 && c <= 0x200A)
-        || c == 0x2028
-        || c == 0x2029
-        || c == 0x202F
-        || c == 0x205F
-        || c == 0x3000
-        ;
-  }
-
-  extern
-  bool is_whitespace (uint8_t const* c) {
-    return is_whitespace(to_int(c));
-  }
-
 
-  extern
-  size_t column_count (uint8_t const* ustr, size_t max_byte_length) {
-    size_t byte_offset = 0;
-    size_t columns = 0;
+  /* Distinct fixed size blocks of a two stage lookup table, stored back to back */
+  struct __BlockSet {
+    uint8_t* data;
+    size_t count;
+    size_t capacity;
+  };
 
-    while (ustr[byte_offset] != '\0' && byte_offset < max_byte_length) {
-      int32_t uchar = to_int(ustr + byte_offset);
-      size_t byte_size = char_size(uchar);
-      columns += utf8proc_charwidth(uchar);
-      byte_offset += byte_size;
+  /* Get the index of a block in a BlockSet, adding it if no identical block is there yet */
+  static
+  uint16_t __intern_block (__BlockSet& set, void const* block, size_t block_size) {
+    for (size_t i = 0; i < set.count; ++ i) {
+      if (memcmp(set.data + i * block_size, block, block_size) == 0) return (uint16_t) i;
     }
 
-    return columns;
-  }
-
-  extern
-  size_t column_count (int32_t c) {
-    return utf8proc_charwidth(c);
-  }
+    if (set.count == set.capacity) {
+      set.capacity = set.capacity == 0? 64 : set.capacity * 2;
+      set.data = (uint8_t*) realloc(set.data, set.capacity * block_size);
 
+      if (set.data == NULL) {
+        printf("Out of memory or other null pointer error while building lookup table\n");
+        abort();
+      }
+    }
 
+    memcpy(set.data + set.count * block_size, block, block_size);
 
-  StringIteratorResult StringIterator::operator * () const {
-    return { index, utf8::to_int(bytes) };
+    return (uint16_t) set.count ++;
   }
 
-  StringIterator& StringIterator::operator ++ () {
-    index ++;
-    bytes += utf8::char_size(bytes);
-    return *this;
-  }
 
-  bool StringIterator::operator != (StringIterator const& other) const {
-    return index != other.index;
-  }
+  /* Table of utf8proc_charwidth, whose widths of 0, 1 or 2 pack four to a byte. The BMP, where nearly all text lives, is one
+   * flat 16KiB stage, and the planes above it go through blocks of 256 that are shared wherever they repeat */
+  struct __WidthTable {
+    uint8_t bmp [0x10000 >> 2];
+    uint16_t blocks [(0x110000 - 0x10000) >> 8];
+    uint8_t const* widths;
+  };
 
+  static
+  __WidthTable __build_width_table () {
+    __WidthTable table;
+    __BlockSet set = { NULL, 0, 0 };
+    uint8_t block [64];
 
+    memset(table.bmp, 0, sizeof(table.bmp));
 
-  void String::dispose () {
-    if (bytes != NULL) {
-      free(bytes);
-      bytes = NULL;
+    for (int32_t c = 0; c < 0x10000; ++ c) {
+      table.bmp[c >> 2] |= (uint8_t) ((utf8proc_charwidth(c) & 3) << ((c & 3) * 2));
     }
 
-    byte_length = 0;
-    byte_capacity = 0;
-  }
+    for (int32_t high = 0x100; high < (0x110000 >> 8); ++ high) {
+      memset(block, 0, sizeof(block));
 
-  uint8_t* String::release () {
-    collapse_allocation();
+      for (int32_t low = 0; low < 256; ++ low) {
+        block[low >> 2] |= (uint8_t) ((utf8proc_charwidth((high << 8) | low) & 3) << ((low & 3) * 2));
+      }
 
-    uint8_t* p = bytes;
+      table.blocks[high - 0x100] = __intern_block(set, block, sizeof(block));
+    }
 
-    bytes = NULL;
-    dispose();
+    table.widths = set.data;
 
-    return p;
+    return table;
   }
 
-  void String::move (String& source) {
-    bytes = source.bytes;
-    byte_length = source.byte_length;
-    byte_capacity = source.byte_capacity;
-    source.bytes = NULL;
-    source.dispose();
+  static
+  __WidthTable const& __width_table () {
+    static __WidthTable const table = __build_width_table();
+    return table;
   }
 
+  static inline
+  size_t __packed_width (uint8_t const* packed, int32_t c) {
+    return (packed[c >> 2] >> ((c & 3) * 2)) & 3;
+  }
 
-  String String::from_file (char const* file_name) {
-    FILE* f;
+  static inline
+  size_t __char_width (__WidthTable const& table, int32_t c) {
+    if ((uint32_t) c < 0x10000) return __packed_width(table.bmp, c);
+    if ((uint32_t) c >= 0x110000) return 1;
+    return __packed_width(table.widths + (size_t) table.blocks[(c >> 8) - 0x100] * 64, c & 0xFF);
+  }
 
-    #ifdef _WIN32
-      f = NULL;
-      fopen_s(&f, file_name, "rb");
-    #else
-      f = fopen(file_name, "rb");
-    #endif
+  /* Shared implementation of column_count for ustrs, which end at NUL, and StringViews, where NUL is data of no width */
+  static
+  size_t __column_count (uint8_t const* ustr, size_t limit, bool stop_at_nul) {
+    __WidthTable const& table = __width_table();
+    uint8_t const* bmp = table.bmp;
+    size_t offset = 0;
+    size_t columns = 0;
 
-    if (f == NULL) {
-      printf("Error reading file \"%s\"\n", file_name);
-      abort();
+    // no sequence is stepped over a NUL here, so stopping at one is the same as ending there,
+    // which also keeps the block loads in __ascii_run from running past the terminator of an unbounded ustr
+    if (stop_at_nul) {
+      uint8_t const* nul = (uint8_t const*) memchr(ustr, 0, limit);
+      if (nul != NULL) limit = (size_t) (nul - ustr);
     }
 
-    fseek(f, 0, SEEK_END);
+    while (offset < limit) {
+      uint8_t c = ustr[offset];
 
-    size_t length = ftell(f);
+      if (c < 0x80) {
+        if (c == '\0') {
+          if (stop_at_nul) break;
+          ++ offset;
+          continue;
+        }
 
-    fseek(f, 0, SEEK_SET);
+        // short runs between wide characters are counted here, the vector kernels only pay off on long ones
+        size_t end = limit - offset > 16? offset + 16 : limit;
 
-    String out { length };
+        do {
+          columns += c >= 0x20 && c != 0x7F;
+          ++ offset;
+        } while (offset < end && (c = ustr[offset]) != '\0' && c < 0x80);
 
-    fread(out.bytes, length, 1, f);
+        if (offset == end && offset < limit) offset += __ascii_run(ustr + offset, limit - offset, columns);
 
-    fclose(f);
+        continue;
+      }
 
-    out.byte_length = length;
-    out.bytes[length] = 0;
+      // continuation bytes are checked before the next is read, so a NUL cutting a sequence short is never stepped over,
+      // and each size has its own branch so the offset steps by a constant the branch predictor can run ahead with
+      uint8_t const* p = ustr + offset;
+
+      if (c >= 0xE0 && c < 0xF0) {
+        // runs of 3 byte sequences, which covers CJK text, stay in this loop
+        size_t start = offset;
+
+        while (limit - offset >= 3 && (p[0] & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+          columns += __packed_width(bmp, ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F));
+          offset += 3;
+          p += 3;
+        }
+
+        if (offset != start) continue;
+      } else if (c >= 0xC0 && c < 0xE0) {
+        if (limit - offset >= 2 && (p[1] & 0xC0) == 0x80) {
+          columns += __packed_width(bmp, ((c & 0x1F) << 6) | (p[1] & 0x3F));
+          offset += 2;
+          continue;
+        }
+      } else if (c >= 0xF0 && c < 0xF5) {
+        if (limit - offset >= 4 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80) {
+          columns += __char_width(table, ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F));
+          offset += 4;
+          continue;
+        }
+      }
 
-    return out;
+      ++ columns;
+      ++ offset;
+    }
+
+    return columns;
   }
 
+  extern
+  size_t column_count (uint8_t const* ustr, size_t max_byte_length) {
+    return __column_count(ustr, max_byte_length, true);
+  }
 
-  void String::to_file (char const* file_name) const {
-    FILE* f;
+  extern
+  size_t column_count (int32_t c) {
+    return __char_width(__width_table(), c);
+  }
 
-    #ifdef _WIN32
-      f = NULL;
-      fopen_s(&f, file_name, "wb");
-    #else
-      f = fopen(file_name, "wb");
-    #endif
 
-    if (f == NULL) {
-      printf("Error reading file \"%s\"\n", file_name);
-      abort();
+  extern
+  char const* error_name (ValidationError error) {
+    switch (error) {
+      case ValidationError::None: return "None";
+      case ValidationError::UnexpectedContinuation: return "UnexpectedContinuation";
+      case ValidationError::MissingContinuation: return "MissingContinuation";
+      case ValidationError::Truncated: return "Truncated";
+      case ValidationError::Overlong: return "Overlong";
+      case ValidationError::Surrogate: return "Surrogate";
+      case ValidationError::TooLarge: return "TooLarge";
+      case ValidationError::InvalidByte: return "InvalidByte";
     }
 
-    fwrite(bytes, byte_length, 1, f);
-
-    fclose(f);
+    return "Unknown";
   }
 
+  /* Check bytes one sequence at a time from a character boundary, skipping ASCII a word at a time */
+  static
+  ValidationResult __validate_scalar (uint8_t const* bytes, size_t offset, size_t byte_length) {
+    while (offset < byte_length) {
+      uint8_t c = bytes[offset];
 
-  void String::collapse_allocation () {
-    if (byte_capacity > byte_length + 1) {
-      bytes = (uint8_t*) realloc(bytes, byte_length + 1);
-      byte_capacity = byte_length + 1;
-    }
-  }
+      if (c < 0x80) {
+        uint64_t word;
 
-  void String::grow_allocation (size_t additional_length) {
+        while (offset + 8 <= byte_length) {
+          memcpy(&word, bytes + offset, 8);
+          if (word & 0x8080808080808080ull) break;
+          offset += 8;
+        }
+
+        while (offset < byte_length && bytes[offset] < 0x80) ++ offset;
+
+        continue;
+      }
+
+      size_t size;
+      uint8_t second_min = 0x80;
+      uint8_t second_max = 0xBF;
+      ValidationError second_error = ValidationError::None;
+
+      if (c < 0xC0) return { ValidationError::UnexpectedContinuation, offset };
+      else if (c < 0xC2) return { ValidationError::Overlong, offset };
+      else if (c < 0xE0) size = 2;
+      else if (c < 0xF0) {
+        size = 3;
+        if (c == 0xE0) { second_min = 0xA0; second_error = ValidationError::Overlong; }
+        else if (c == 0xED) { second_max = 0x9F; second_error = ValidationError::Surrogate; }
+      } else if (c < 0xF5) {
+        size = 4;
+        if (c == 0xF0) { second_min = 0x90; second_error = ValidationError::Overlong; }
+        else if (c == 0xF4) { second_max = 0x8F; second_error = ValidationError::TooLarge; }
+      }
+      else if (c < 0xF8) return { ValidationError::TooLarge, offset };
+      else return { ValidationError::InvalidByte, offset };
+
+      for (size_t i = 1; i < size; ++ i) {
+        if (offset + i >= byte_length) return { ValidationError::Truncated, offset };
+
+        uint8_t b = bytes[offset + i];
+
+        if ((b & 0xC0) != 0x80) return { ValidationError::MissingContinuation, offset };
+        if (i == 1 && (b < second_min || b > second_max)) return { second_error, offset };
+      }
+
+      offset += size;
+    }
+
+    return { ValidationError::None, byte_length };
+  }
+
+  #ifdef UTF8_X86
+    /* Lookup tables for the vectorized validator (Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte").
+     * Each byte pair is classified by the high nibble of the first byte, the low nibble of the first byte and the high nibble of the second,
+     * and the pair is an error if all three lookups agree on an error bit */
+    static constexpr uint8_t __TOO_SHORT = 1 << 0;      // 11______ 0_______ / 11______ 11______
+    static constexpr uint8_t __TOO_LONG = 1 << 1;       // 0_______ 10______
+    static constexpr uint8_t __OVERLONG_3 = 1 << 2;     // 11100000 100_____
+    static constexpr uint8_t __TOO_LARGE = 1 << 3;      // 11110100 1001____ / 11110100 101_____ / 11110101+ 1001____ ...
+    static constexpr uint8_t __SURROGATE = 1 << 4;      // 11101101 101_____
+    static constexpr uint8_t __OVERLONG_2 = 1 << 5;     // 1100000_ 10______
+    static constexpr uint8_t __TOO_LARGE_1000 = 1 << 6; // 11110101+ 1000____
+    static constexpr uint8_t __OVERLONG_4 = 1 << 6;     // 11110000 1000____
+    static constexpr uint8_t __TWO_CONTS = 1 << 7;      // 10______ 10______ (Allowed when a 3 or 4 byte lead is in reach)
+    static constexpr uint8_t __CARRY = __TOO_SHORT | __TOO_LONG | __TWO_CONTS;
+
+    alignas(16) static uint8_t const __BYTE_1_HIGH [16] = {
+      __TOO_LONG, __TOO_LONG, __TOO_LONG, __TOO_LONG,
+      __TOO_LONG, __TOO_LONG, __TOO_LONG, __TOO_LONG,
+      __TWO_CONTS, __TWO_CONTS, __TWO_CONTS, __TWO_CONTS,
+      __TOO_SHORT | __OVERLONG_2,
+      __TOO_SHORT,
+      __TOO_SHORT | __OVERLONG_3 | __SURROGATE,
+      __TOO_SHORT | __TOO_LARGE | __TOO_LARGE_1000 | __OVERLONG_4,
+    };
+
+    alignas(16) static uint8_t const __BYTE_1_LOW [16] = {
+      __CARRY | __OVERLONG_3 | __OVERLONG_2 | __OVERLONG_4,
+      __CARRY | __OVERLONG_2,
+      __CARRY,
+      __CARRY,
+      __CARRY | __TOO_LARGE,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000 | __SURROGATE,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+      __CARRY | __TOO_LARGE | __TOO_LARGE_1000,
+    };
+
+    alignas(16) static uint8_t const __BYTE_2_HIGH [16] = {
+      __TOO_SHORT, __TOO_SHORT, __TOO_SHORT, __TOO_SHORT,
+      __TOO_SHORT, __TOO_SHORT, __TOO_SHORT, __TOO_SHORT,
+      __TOO_LONG | __OVERLONG_2 | __TWO_CONTS | __OVERLONG_3 | __TOO_LARGE_1000 | __OVERLONG_4,
+      __TOO_LONG | __OVERLONG_2 | __TWO_CONTS | __OVERLONG_3 | __TOO_LARGE,
+      __TOO_LONG | __OVERLONG_2 | __TWO_CONTS | __SURROGATE | __TOO_LARGE,
+      __TOO_LONG | __OVERLONG_2 | __TWO_CONTS | __SURROGATE | __TOO_LARGE,
+      __TOO_SHORT, __TOO_SHORT, __TOO_SHORT, __TOO_SHORT,
+    };
+
+    /* The validation kernels return the offset of the first block holding an error (Or of the unprocessed tail),
+     * every sequence that ends before that offset is known to be well formed */
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __validate_avx2 (uint8_t const* bytes, size_t byte_length) {
+      __m256i const byte_1_high = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*) __BYTE_1_HIGH));
+      __m256i const byte_1_low = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*) __BYTE_1_LOW));
+      __m256i const byte_2_high = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i const*) __BYTE_2_HIGH));
+      __m256i const nibble = _mm256_set1_epi8(0x0F);
+      __m256i const high_bit = _mm256_set1_epi8((char) 0x80);
+      __m256i const incomplete_max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1)
+      );
+
+      __m256i prev_input = _mm256_setzero_si256();
+      __m256i prev_incomplete = _mm256_setzero_si256();
+      size_t offset = 0;
+
+      for (; offset + 32 <= byte_length; offset += 32) {
+        __m256i input = _mm256_loadu_si256((__m256i const*) (bytes + offset));
+        __m256i error;
+
+        if (_mm256_movemask_epi8(input) == 0) {
+          error = prev_incomplete;
+          prev_incomplete = _mm256_setzero_si256();
+        } else {
+          __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+          __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+          __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+          __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+          __m256i special = _mm256_and_si256(
+            _mm256_and_si256(
+              _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+              _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))
+            ),
+            _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble))
+          );
+
+          __m256i must_continue = _mm256_and_si256(
+            _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xE0 - 0x80))), _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xF0 - 0x80)))),
+            high_bit
+          );
+
+          error = _mm256_xor_si256(must_continue, special);
+          prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+        }
+
+        if (!_mm256_testz_si256(error, error)) break;
+
+        prev_input = input;
+      }
+
+      return offset;
+    }
+
+    UTF8_TARGET("avx512f,avx512bw")
+    static
+    size_t __validate_avx512 (uint8_t const* bytes, size_t byte_length) {
+      __m512i const byte_1_high = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128((__m128i const*) __BYTE_1_HIGH));
+      __m512i const byte_1_low = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128((__m128i const*) __BYTE_1_LOW));
+      __m512i const byte_2_high = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128((__m128i const*) __BYTE_2_HIGH));
+      __m512i const nibble = _mm512_set1_epi8(0x0F);
+      __m512i const high_bit = _mm512_set1_epi8((char) 0x80);
+      __m512i const lane_shift = _mm512_set_epi64(13, 12, 11, 10, 9, 8, 7, 6);
+      __m512i const incomplete_max = _mm512_mask_blend_epi8(
+        0xE000000000000000ull,
+        _mm512_set1_epi8(-1),
+        _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1)))
+      );
+
+      __m512i prev_input = _mm512_setzero_si512();
+      __m512i prev_incomplete = _mm512_setzero_si512();
+      size_t offset = 0;
+
+      for (; offset + 64 <= byte_length; offset += 64) {
+        __m512i input = _mm512_loadu_si512((void const*) (bytes + offset));
+        __m512i error;
+
+        if (_mm512_movepi8_mask(input) == 0) {
+          error = prev_incomplete;
+          prev_incomplete = _mm512_setzero_si512();
+        } else {
+          __m512i shifted = _mm512_permutex2var_epi64(prev_input, lane_shift, input);
+          __m512i prev1 = _mm512_alignr_epi8(input, shifted, 15);
+          __m512i prev2 = _mm512_alignr_epi8(input, shifted, 14);
+          __m512i prev3 = _mm512_alignr_epi8(input, shifted, 13);
+
+          __m512i special = _mm512_and_si512(
+            _mm512_and_si512(
+              _mm512_shuffle_epi8(byte_1_high, _mm512_and_si512(_mm512_srli_epi16(prev1, 4), nibble)),
+              _mm512_shuffle_epi8(byte_1_low, _mm512_and_si512(prev1, nibble))
+            ),
+            _mm512_shuffle_epi8(byte_2_high, _mm512_and_si512(_mm512_srli_epi16(input, 4), nibble))
+          );
+
+          __m512i must_continue = _mm512_and_si512(
+            _mm512_or_si512(_mm512_subs_epu8(prev2, _mm512_set1_epi8((char) (0xE0 - 0x80))), _mm512_subs_epu8(prev3, _mm512_set1_epi8((char) (0xF0 - 0x80)))),
+            high_bit
+          );
+
+          error = _mm512_xor_si512(must_continue, special);
+          prev_incomplete = _mm512_subs_epu8(input, incomplete_max);
+        }
+
+        if (_mm512_test_epi8_mask(error, error)) break;
+
+        prev_input = input;
+      }
+
+      return offset;
+    }
+  #endif
+
+  static
+  size_t __validate_blocks (uint8_t const* bytes, size_t byte_length) {
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512: return __validate_avx512(bytes, byte_length);
+        case SimdLevel::AVX2: return __validate_avx2(bytes, byte_length);
+      #endif
+      // the lookup approach needs a byte shuffle, which plain SSE2 lacks
+      default: return 0;
+    }
+  }
+
+  extern
+  ValidationResult validate (uint8_t const* bytes, size_t byte_length) {
+    size_t offset = __validate_blocks(bytes, byte_length);
+
+    // the kernels stop on a block boundary and an error there can belong to a lead byte just before it,
+    // so rescan from the closest one in reach
+    for (size_t back = 1; back <= 3 && back <= offset; ++ back) {
+      uint8_t c = bytes[offset - back];
+
+      if (c < 0x80) break;
+
+      if (c >= 0xC0) {
+        offset -= back;
+        break;
+      }
+    }
+
+    return __validate_scalar(bytes, offset, byte_length);
+  }
+
+  extern
+  ValidationResult validate (char const* bytes, size_t byte_length) {
+    return validate((uint8_t const*) bytes, byte_length);
+  }
+
+  extern
+  ValidationResult validate (uint8_t const* ustr) {
+    return validate(ustr, byte_count(ustr));
+  }
+
+
+  static inline
+  unsigned __trailing_zeros (uint64_t x) {
+    #if defined(__GNUC__) || defined(__clang__)
+      return __builtin_ctzll(x);
+    #else
+      unsigned n = 0;
+      while (!(x & 1)) { x >>= 1; ++ n; }
+      return n;
+    #endif
+  }
+
+  static inline
+  unsigned __highest_bit (uint32_t x) {
+    #if defined(__GNUC__) || defined(__clang__)
+      return 31 - __builtin_clz(x);
+    #else
+      unsigned n = 31;
+      while (!(x >> n)) -- n;
+      return n;
+    #endif
+  }
+
+  /* Decode the sequence at an offset the way to_int does, substituting U+FFFD if it runs past the end of the segment */
+  static inline
+  void __decode_step (uint8_t const* src, size_t& offset, size_t byte_length, int32_t* dst, size_t& written) {
+    uint8_t const* c = src + offset;
+    uint8_t size = __lead_size(*c);
+
+    if (offset + size > byte_length) {
+      dst[written ++] = 0xFFFD;
+      offset = byte_length;
+      return;
+    }
+
+    switch (size) {
+      case 1: dst[written] = *c; break;
+      case 2: dst[written] = ((c[0] & 31) << 6) | (c[1] & 63); break;
+      case 3: dst[written] = ((c[0] & 15) << 12) | ((c[1] & 63) << 6) | (c[2] & 63); break;
+      case 4: dst[written] = ((c[0] & 7) << 18) | ((c[1] & 63) << 12) | ((c[2] & 63) << 6) | (c[3] & 63); break;
+    }
+
+    ++ written;
+    offset += size;
+  }
+
+  /* Decode a block no fast path took, one sequence at a time (The ASCII bytes up to the first non-ASCII byte are copied straight) */
+  static inline
+  void __decode_block (uint8_t const* src, size_t& offset, size_t byte_length, int32_t* dst, size_t& written, uint64_t high, size_t width) {
+    size_t end = offset + width;
+    for (unsigned ascii = __trailing_zeros(high); ascii > 0; -- ascii) dst[written ++] = src[offset ++];
+    while (offset < end) __decode_step(src, offset, byte_length, dst, written);
+  }
+
+  #ifdef UTF8_X86
+    /* The transcoding kernels take whole blocks when they are all ASCII, or a run of only 2 byte or only 3 byte sequences,
+     * and fall back to one sequence at a time otherwise. Lead and continuation bytes are checked to sit exactly where a char_size walk puts them,
+     * so malformed input decodes just like the scalar path */
+
+    static
+    size_t __decode_sse2 (uint8_t const* src, size_t byte_length, int32_t* dst) {
+      __m128i const zero = _mm_setzero_si128();
+      size_t offset = 0;
+      size_t written = 0;
+
+      while (offset + 16 <= byte_length) {
+        __m128i v = _mm_loadu_si128((__m128i const*) (src + offset));
+        uint32_t high = (uint32_t) _mm_movemask_epi8(v);
+
+        if (high == 0) {
+          __m128i lo = _mm_unpacklo_epi8(v, zero);
+          __m128i hi = _mm_unpackhi_epi8(v, zero);
+          _mm_storeu_si128((__m128i*) (dst + written + 0), _mm_unpacklo_epi16(lo, zero));
+          _mm_storeu_si128((__m128i*) (dst + written + 4), _mm_unpackhi_epi16(lo, zero));
+          _mm_storeu_si128((__m128i*) (dst + written + 8), _mm_unpacklo_epi16(hi, zero));
+          _mm_storeu_si128((__m128i*) (dst + written + 12), _mm_unpackhi_epi16(hi, zero));
+          offset += 16;
+          written += 16;
+          continue;
+        }
+
+        uint32_t cont = (uint32_t) _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8(-64)));
+        uint32_t lead2 = high & ~cont & ~(uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(-33)));
+
+        if (cont == 0xAAAA && lead2 == 0x5555) {
+          // little endian, so each 16 bit lane holds the lead byte low and the continuation byte high
+          __m128i r = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x1F)), 6),
+            _mm_and_si128(_mm_srli_epi16(v, 8), _mm_set1_epi16(0x3F))
+          );
+          _mm_storeu_si128((__m128i*) (dst + written + 0), _mm_unpacklo_epi16(r, zero));
+          _mm_storeu_si128((__m128i*) (dst + written + 4), _mm_unpackhi_epi16(r, zero));
+          offset += 16;
+          written += 8;
+          continue;
+        }
+
+        __decode_block(src, offset, byte_length, dst, written, high, 16);
+      }
+
+      while (offset < byte_length) __decode_step(src, offset, byte_length, dst, written);
+
+      return written;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __decode_avx2 (uint8_t const* src, size_t byte_length, int32_t* dst) {
+      __m128i const three_byte_order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+      size_t offset = 0;
+      size_t written = 0;
+
+      while (offset + 32 <= byte_length) {
+        __m256i v = _mm256_loadu_si256((__m256i const*) (src + offset));
+        uint32_t high = (uint32_t) _mm256_movemask_epi8(v);
+
+        if (high == 0) {
+          __m128i lo = _mm256_castsi256_si128(v);
+          __m128i hi = _mm256_extracti128_si256(v, 1);
+          _mm256_storeu_si256((__m256i*) (dst + written + 0), _mm256_cvtepu8_epi32(lo));
+          _mm256_storeu_si256((__m256i*) (dst + written + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+          _mm256_storeu_si256((__m256i*) (dst + written + 16), _mm256_cvtepu8_epi32(hi));
+          _mm256_storeu_si256((__m256i*) (dst + written + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+          offset += 32;
+          written += 32;
+          continue;
+        }
+
+        uint32_t cont = (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v));
+        uint32_t lead3_up = high & (uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-33)));
+        uint32_t lead2 = high & ~cont & ~lead3_up;
+        uint32_t lead3 = lead3_up & ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-17)));
+
+        if ((cont & 0xFFFF) == 0xAAAA && (lead2 & 0xFFFF) == 0x5555) {
+          __m256i r = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x1F)), 6),
+            _mm256_and_si256(_mm256_srli_epi16(v, 8), _mm256_set1_epi16(0x3F))
+          );
+          _mm256_storeu_si256((__m256i*) (dst + written), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(r)));
+
+          if (cont == 0xAAAAAAAA && lead2 == 0x55555555) {
+            _mm256_storeu_si256((__m256i*) (dst + written + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(r, 1)));
+            offset += 32;
+            written += 16;
+          } else {
+            offset += 16;
+            written += 8;
+          }
+
+          continue;
+        }
+
+        if ((cont & 0xFFF) == 0xDB6 && (lead3 & 0xFFF) == 0x249) {
+          // each 12 byte half becomes 4 lanes of lead, continuation, continuation in reverse order so the bits line up
+          bool full = (cont & 0xFFFFFF) == 0xDB6DB6 && (lead3 & 0xFFFFFF) == 0x249249;
+
+          __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_castsi256_si128(v)), _mm_loadu_si128((__m128i const*) (src + offset + 12)), 1);
+          x = _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(three_byte_order));
+
+          __m256i r = _mm256_or_si256(
+            _mm256_or_si256(
+              _mm256_and_si256(x, _mm256_set1_epi32(0x3F)),
+              _mm256_and_si256(_mm256_srli_epi32(x, 2), _mm256_set1_epi32(0xFC0))
+            ),
+            _mm256_and_si256(_mm256_srli_epi32(x, 4), _mm256_set1_epi32(0xF000))
+          );
+
+          if (full) {
+            _mm256_storeu_si256((__m256i*) (dst + written), r);
+            offset += 24;
+            written += 8;
+          } else {
+            _mm_storeu_si128((__m128i*) (dst + written), _mm256_castsi256_si128(r));
+            offset += 12;
+            written += 4;
+          }
+
+          continue;
+        }
+
+        __decode_block(src, offset, byte_length, dst, written, high, 32);
+      }
+
+      while (offset < byte_length) __decode_step(src, offset, byte_length, dst, written);
+
+      return written;
+    }
+
+
+    static
+    size_t __encode_sse2 (int32_t const* src, size_t count, uint8_t* dst) {
+      __m128i const zero = _mm_setzero_si128();
+      size_t i = 0;
+      size_t written = 0;
+
+      while (i + 8 <= count) {
+        __m128i a = _mm_loadu_si128((__m128i const*) (src + i));
+        __m128i b = _mm_loadu_si128((__m128i const*) (src + i + 4));
+        __m128i both = _mm_or_si128(a, b);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(both, _mm_set1_epi32(~0x7F)), zero)) == 0xFFFF) {
+          __m128i words = _mm_packs_epi32(a, b);
+          _mm_storel_epi64((__m128i*) (dst + written), _mm_packus_epi16(words, words));
+          i += 8;
+          written += 8;
+          continue;
+        }
+
+        __m128i above_ascii = _mm_and_si128(_mm_cmpgt_epi32(a, _mm_set1_epi32(0x7F)), _mm_cmpgt_epi32(b, _mm_set1_epi32(0x7F)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(both, _mm_set1_epi32(~0x7FF)), zero)) == 0xFFFF
+        &&  _mm_movemask_epi8(above_ascii) == 0xFFFF) {
+          auto pairs = [] (__m128i c) {
+            __m128i lead = _mm_or_si128(_mm_srli_epi32(c, 6), _mm_set1_epi32(0xC0));
+            __m128i cont = _mm_or_si128(_mm_and_si128(c, _mm_set1_epi32(0x3F)), _mm_set1_epi32(0x80));
+            // biased so the signed pack below can't saturate
+            return _mm_xor_si128(_mm_or_si128(lead, _mm_slli_epi32(cont, 8)), _mm_set1_epi32(0x8000));
+          };
+
+          __m128i words = _mm_xor_si128(_mm_packs_epi32(pairs(a), pairs(b)), _mm_set1_epi16((short) 0x8000));
+          _mm_storeu_si128((__m128i*) (dst + written), words);
+          i += 8;
+          written += 16;
+          continue;
+        }
+
+        for (size_t end = i + 8; i < end; ++ i) written += encode(src[i], dst + written);
+      }
+
+      while (i < count) written += encode(src[i ++], dst + written);
+
+      return written;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __encode_avx2 (int32_t const* src, size_t count, uint8_t* dst) {
+      __m256i const zero = _mm256_setzero_si256();
+      __m128i const three_byte_pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+      size_t i = 0;
+      size_t written = 0;
+
+      while (i + 16 <= count) {
+        __m256i a = _mm256_loadu_si256((__m256i const*) (src + i));
+        __m256i b = _mm256_loadu_si256((__m256i const*) (src + i + 8));
+
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_set1_epi32(~0x7F))) {
+          __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+          _mm_storeu_si128((__m128i*) (dst + written), _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)));
+          i += 16;
+          written += 16;
+          continue;
+        }
+
+        bool above_ascii = _mm256_movemask_epi8(_mm256_cmpgt_epi32(a, _mm256_set1_epi32(0x7F))) == -1;
+
+        if (above_ascii && _mm256_testz_si256(a, _mm256_set1_epi32(~0x7FF))) {
+          __m256i lead = _mm256_or_si256(_mm256_srli_epi32(a, 6), _mm256_set1_epi32(0xC0));
+          __m256i cont = _mm256_or_si256(_mm256_and_si256(a, _mm256_set1_epi32(0x3F)), _mm256_set1_epi32(0x80));
+          __m256i words = _mm256_or_si256(lead, _mm256_slli_epi32(cont, 8));
+          words = _mm256_permute4x64_epi64(_mm256_packus_epi32(words, zero), 0xD8);
+          _mm_storeu_si128((__m128i*) (dst + written), _mm256_castsi256_si128(words));
+          i += 8;
+          written += 16;
+          continue;
+        }
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(a, _mm256_set1_epi32(0x7FF))) == -1
+        &&  _mm256_testz_si256(a, _mm256_set1_epi32(~0xFFFF))) {
+          __m256i lead = _mm256_or_si256(_mm256_srli_epi32(a, 12), _mm256_set1_epi32(0xE0));
+          __m256i cont1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(a, 6), _mm256_set1_epi32(0x3F)), _mm256_set1_epi32(0x80));
+          __m256i cont2 = _mm256_or_si256(_mm256_and_si256(a, _mm256_set1_epi32(0x3F)), _mm256_set1_epi32(0x80));
+          __m256i triples = _mm256_or_si256(_mm256_or_si256(lead, _mm256_slli_epi32(cont1, 8)), _mm256_slli_epi32(cont2, 16));
+          triples = _mm256_shuffle_epi8(triples, _mm256_broadcastsi128_si256(three_byte_pack));
+
+          // 12 useful bytes per half, go through the stack rather than store past what the caller sized dst for
+          alignas(32) uint8_t packed [32];
+          _mm256_store_si256((__m256i*) packed, triples);
+          memcpy(dst + written, packed, 12);
+          memcpy(dst + written + 12, packed + 16, 12);
+          i += 8;
+          written += 24;
+          continue;
+        }
+
+        for (size_t end = i + 8; i < end; ++ i) written += encode(src[i], dst + written);
+      }
+
+      while (i < count) written += encode(src[i ++], dst + written);
+
+      return written;
+    }
+  #endif
+
+  extern
+  size_t utf32_length (uint8_t const* src, size_t byte_length) {
+    return __char_count(src, byte_length, false);
+  }
+
+  extern
+  size_t utf8_length (int32_t const* src, size_t count) {
+    size_t length = 0;
+
+    for (size_t i = 0; i < count; ++ i) length += char_size(src[i]);
+
+    return length;
+  }
+
+  extern
+  size_t decode_to_utf32 (uint8_t const* src, size_t byte_length, int32_t* dst) {
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        // the AVX2 kernel already runs into the store bandwidth, wider blocks don't buy anything here
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: return __decode_avx2(src, byte_length, dst);
+        case SimdLevel::SSE2: return __decode_sse2(src, byte_length, dst);
+      #endif
+      default: {
+        size_t offset = 0;
+        size_t written = 0;
+        while (offset < byte_length) __decode_step(src, offset, byte_length, dst, written);
+        return written;
+      }
+    }
+  }
+
+  extern
+  size_t encode_from_utf32 (int32_t const* src, size_t count, uint8_t* dst) {
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: return __encode_avx2(src, count, dst);
+        case SimdLevel::SSE2: return __encode_sse2(src, count, dst);
+      #endif
+      default: {
+        size_t written = 0;
+        for (size_t i = 0; i < count; ++ i) written += encode(src[i], dst + written);
+        return written;
+      }
+    }
+  }
+
+
+
+  /* Two stage table of the difference a case mapping makes to each grapheme, indexed by its high bits then its low 8 bits
+   * (Blocks of 256 deltas are shared wherever they repeat, which most of the code space does as all 0) */
+  struct __CaseTable {
+    uint16_t blocks [0x110000 >> 8];
+    int32_t* deltas;
+  };
+
+  static
+  __CaseTable __build_case_table (int32_t (*map) (int32_t)) {
+    __CaseTable table;
+    __BlockSet set = { NULL, 0, 0 };
+    int32_t block [256];
+
+    for (int32_t high = 0; high < (0x110000 >> 8); ++ high) {
+      for (int32_t low = 0; low < 256; ++ low) {
+        int32_t c = (high << 8) | low;
+        block[low] = map(c) - c;
+      }
+
+      table.blocks[high] = __intern_block(set, block, sizeof(block));
+    }
+
+    table.deltas = (int32_t*) set.data;
+
+    return table;
+  }
+
+  static
+  __CaseTable const& __lowercase_table () {
+    static __CaseTable const table = __build_case_table(utf8proc_tolower);
+    return table;
+  }
+
+  static
+  __CaseTable const& __uppercase_table () {
+    static __CaseTable const table = __build_case_table(utf8proc_toupper);
+    return table;
+  }
+
+  static inline
+  int32_t __case_lookup (__CaseTable const& table, int32_t c) {
+    if ((uint32_t) c >= 0x110000) return c;
+    return c + table.deltas[(size_t) table.blocks[c >> 8] * 256 + (c & 0xFF)];
+  }
+
+
+  #ifdef UTF8_X86
+    static
+    size_t __ascii_case_sse2 (uint8_t const* src, size_t length, uint8_t* dst, bool upper) {
+      __m128i const before = _mm_set1_epi8(upper? 'a' - 1 : 'A' - 1);
+      __m128i const after = _mm_set1_epi8(upper? 'z' + 1 : 'Z' + 1);
+      __m128i const case_bit = _mm_set1_epi8(0x20);
+      size_t i = 0;
+
+      for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*) (src + i));
+        if (_mm_movemask_epi8(v) != 0) break;
+
+        // signed compares are fine here, every byte is known to be ASCII
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(v, before), _mm_cmplt_epi8(v, after));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(v, _mm_and_si128(letter, case_bit)));
+      }
+
+      return i;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __ascii_case_avx2 (uint8_t const* src, size_t length, uint8_t* dst, bool upper) {
+      __m256i const before = _mm256_set1_epi8(upper? 'a' - 1 : 'A' - 1);
+      __m256i const after = _mm256_set1_epi8(upper? 'z' + 1 : 'Z' + 1);
+      __m256i const case_bit = _mm256_set1_epi8(0x20);
+      size_t i = 0;
+
+      for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const*) (src + i));
+        if (_mm256_movemask_epi8(v) != 0) break;
+
+        __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(v, before), _mm256_cmpgt_epi8(after, v));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(v, _mm256_and_si256(letter, case_bit)));
+      }
+
+      return i;
+    }
+  #endif
+
+  /* Case convert the run of ASCII at the start of a segment, returning its length (dst may be src) */
+  static inline
+  size_t __ascii_case (uint8_t const* src, size_t length, uint8_t* dst, bool upper) {
+    size_t i = 0;
+
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: i = __ascii_case_avx2(src, length, dst, upper); break;
+        case SimdLevel::SSE2: i = __ascii_case_sse2(src, length, dst, upper); break;
+      #endif
+      default: break;
+    }
+
+    uint8_t const first = upper? 'a' : 'A';
+
+    for (; i < length && src[i] < 0x80; ++ i) {
+      dst[i] = src[i] ^ ((uint8_t) (src[i] - first) < 26? 0x20 : 0);
+    }
+
+    return i;
+  }
+
+  /* Case convert a segment into a buffer, returning the size of the whole result (Writes stop at the first sequence that doesn't fit).
+   * Stray continuation and invalid bytes, and a sequence cut off by the end, are copied as they are */
+  static
+  size_t __case_convert (__CaseTable const& table, bool upper, uint8_t const* src, size_t length, uint8_t* dst, size_t capacity) {
+    size_t i = 0;
+    size_t written = 0;
+    bool full = false;
+
+    while (i < length) {
+      uint8_t c = src[i];
+
+      if (c < 0x80 && !full) {
+        size_t room = capacity - written;
+        size_t run = __ascii_case(src + i, length - i < room? length - i : room, dst + written, upper);
+
+        i += run;
+        written += run;
+
+        if (run > 0) continue;
+      }
+
+      uint8_t const* out = src + i;
+      size_t size = __lead_size(c);
+      size_t out_size = size;
+      uint8_t mapped [4];
+
+      if (size > length - i) {
+        out_size = size = length - i;
+      } else if (c >= 0xC0 && c < 0xF8) {
+        int32_t original = utf8::to_int(src + i);
+        int32_t converted = __case_lookup(table, original);
+
+        if (converted != original) {
+          out_size = utf8::encode(converted, mapped);
+          out = mapped;
+        }
+      }
+
+      if (!full && out_size <= capacity - written) memcpy(dst + written, out, out_size);
+      else full = true;
+
+      i += size;
+      written += out_size;
+    }
+
+    return written;
+  }
+
+  /* Case convert a segment in place up to the first grapheme whose converted form has a different size, returning where that is */
+  static
+  size_t __case_in_place (__CaseTable const& table, bool upper, uint8_t* bytes, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+      uint8_t c = bytes[i];
+
+      if (c < 0x80) {
+        i += __ascii_case(bytes + i, length - i, bytes + i, upper);
+        continue;
+      }
+
+      size_t size = __lead_size(c);
+
+      if (size > length - i) break;
+
+      if (c >= 0xC0 && c < 0xF8) {
+        int32_t original = utf8::to_int(bytes + i);
+        int32_t converted = __case_lookup(table, original);
+
+        if (converted != original) {
+          if (utf8::char_size(converted) != size) return i;
+          utf8::encode(converted, bytes + i);
+        }
+      }
+
+      i += size;
+    }
+
+    return length;
+  }
+
+
+  extern
+  int32_t to_lowercase (int32_t c) {
+    return __case_lookup(__lowercase_table(), c);
+  }
+
+  extern
+  int32_t to_uppercase (int32_t c) {
+    return __case_lookup(__uppercase_table(), c);
+  }
+
+  extern
+  size_t to_lowercase (uint8_t const* src, size_t byte_length, uint8_t* dst, size_t dst_capacity) {
+    return __case_convert(__lowercase_table(), false, src, byte_length, dst, dst_capacity);
+  }
+
+  extern
+  size_t to_uppercase (uint8_t const* src, size_t byte_length, uint8_t* dst, size_t dst_capacity) {
+    return __case_convert(__uppercase_table(), true, src, byte_length, dst, dst_capacity);
+  }
+
+
+
+  StringIteratorResult StringIterator::operator * () const {
+    return { index, utf8::to_int(bytes) };
+  }
+
+  StringIterator& StringIterator::operator ++ () {
+    index ++;
+    bytes += utf8::char_size(bytes);
+    return *this;
+  }
+
+  bool StringIterator::operator != (StringIterator const& other) const {
+    // ordered rather than equal, so a malformed sequence at the end can't step over the sentinel
+    return bytes < other.bytes;
+  }
+
+
+
+  #ifdef UTF8_STATS
+    /* Counters of one thread, whose tags live in a fixed table so StatsTags can point into it */
+    struct __StatsState {
+      Stats totals;
+      TaggedStats tags [MAX_STATS_TAGS];
+      size_t tag_count;
+      Stats* current;
+    };
+
+    static thread_local __StatsState __stats;
+
+    extern
+    void count_stat (size_t Stats::* counter, size_t amount) {
+      __stats.totals.*counter += amount;
+      if (__stats.current != NULL) __stats.current->*counter += amount;
+    }
+
+    extern
+    Stats stats_snapshot () {
+      return __stats.totals;
+    }
+
+    extern
+    size_t tagged_stats_snapshot (TaggedStats* out, size_t capacity) {
+      for (size_t i = 0; i < __stats.tag_count && i < capacity; ++ i) out[i] = __stats.tags[i];
+      return __stats.tag_count;
+    }
+
+    extern
+    void reset_stats () {
+      __stats.totals = { };
+      for (size_t i = 0; i < __stats.tag_count; ++ i) __stats.tags[i].stats = { };
+    }
+
+    StatsTag::StatsTag (char const* tag)
+    : previous(__stats.current)
+    {
+      Stats* stats = NULL;
+
+      for (size_t i = 0; i < __stats.tag_count && stats == NULL; ++ i) {
+        if (__stats.tags[i].tag == tag) stats = &__stats.tags[i].stats;
+      }
+
+      if (stats == NULL && __stats.tag_count < MAX_STATS_TAGS) {
+        TaggedStats& entry = __stats.tags[__stats.tag_count ++];
+        entry.tag = tag;
+        entry.stats = { };
+        stats = &entry.stats;
+      }
+
+      __stats.current = stats;
+    }
+
+    StatsTag::~StatsTag () {
+      __stats.current = previous;
+    }
+  #else
+    extern
+    void count_stat (size_t Stats::*, size_t) { }
+
+    extern
+    Stats stats_snapshot () {
+      return { };
+    }
+
+    extern
+    size_t tagged_stats_snapshot (TaggedStats*, size_t) {
+      return 0;
+    }
+
+    extern
+    void reset_stats () { }
+  #endif
+
+
+  /* Get memory for a String from its allocator, or malloc when it has none */
+  static inline
+  void* __allocate (Allocator const* allocator, size_t size) {
+    UTF8_STAT(allocations, 1);
+    UTF8_STAT(allocated_bytes, size);
+    return allocator != NULL? allocator->allocate(allocator->user, size) : malloc(size);
+  }
+
+  /* Resize memory of a String through its allocator, or realloc when it has none */
+  static inline
+  void* __reallocate (Allocator const* allocator, void* ptr, size_t old_size, size_t new_size) {
+    UTF8_STAT(reallocations, 1);
+    UTF8_STAT(allocated_bytes, new_size > old_size? new_size - old_size : 0);
+    return allocator != NULL? allocator->reallocate(allocator->user, ptr, old_size, new_size) : realloc(ptr, new_size);
+  }
+
+  /* Shift bytes within a String, the memmove behind insert_at, remove, insert_fmt_at_va, trim and collapse_whitespace */
+  static inline
+  void __shift_bytes (uint8_t* dst, uint8_t const* src, size_t length) {
+    UTF8_STAT(moves, 1);
+    UTF8_STAT(moved_bytes, length);
+    memmove(dst, src, length);
+  }
+
+  /* Give memory of a String back to its allocator, or free it when it has none */
+  static inline
+  void __deallocate (Allocator const* allocator, void* ptr, size_t size) {
+    if (allocator != NULL) allocator->deallocate(allocator->user, ptr, size);
+    else free(ptr);
+  }
+
+
+  struct SharedBuffer {
+    std::atomic<size_t> references;
+    Allocator const* allocator; // The one the buffer was allocated with, which may not be the String's own after assign
+    size_t capacity;
+  };
+
+  static_assert(sizeof(SharedBuffer) % alignof(size_t) == 0, "SharedBuffer bytes must follow its header directly");
+
+  static inline
+  uint8_t* __shared_bytes (SharedBuffer* buffer) {
+    return (uint8_t*) (buffer + 1);
+  }
+
+  /* Drop a reference to a SharedBuffer, freeing it with the last one */
+  static
+  void __shared_release (SharedBuffer* buffer) {
+    if (buffer->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      Allocator const* allocator = buffer->allocator;
+      size_t size = sizeof(SharedBuffer) + buffer->capacity;
+
+      buffer->~SharedBuffer();
+      __deallocate(allocator, buffer, size);
+    }
+  }
+
+
+  /* Walk the char_index of a String forward until it has an entry for a grapheme index or reaches the end */
+  static
+  void __char_index_extend (String const& s, size_t entry) {
+    CharIndex* ix = s.char_index;
+
+    if (ix == NULL) {
+      ix = s.char_index = (CharIndex*) __allocate(s.allocator, sizeof(CharIndex));
+      if (ix == NULL) {
+        printf("Out of memory or other null pointer error while building String char index\n");
+        abort();
+      }
+
+      *ix = { };
+    }
+
+    if (ix->count == 0) {
+      ix->capacity = 16;
+      ix->offsets = (size_t*) __allocate(s.allocator, ix->capacity * sizeof(size_t));
+
+      if (ix->offsets == NULL) {
+        printf("Out of memory or other null pointer error while building String char index\n");
+        abort();
+      }
+
+      ix->offsets[ix->count ++] = 0;
+    }
+
+    size_t offset = ix->offsets[ix->count - 1];
+
+    while (ix->count <= entry && !ix->complete) {
+      size_t stepped = 0;
+
+      for (; stepped < String::CHAR_INDEX_STRIDE; ++ stepped) {
+        if (offset >= s.byte_length || s.bytes[offset] == '\0') break;
+        offset += __lead_size(s.bytes[offset]);
+      }
+
+      if (stepped < String::CHAR_INDEX_STRIDE) {
+        ix->complete = true;
+        break;
+      }
+
+      if (ix->count == ix->capacity) {
+        ix->offsets = (size_t*) __reallocate(s.allocator, ix->offsets, ix->capacity * sizeof(size_t), ix->capacity * 2 * sizeof(size_t));
+        ix->capacity *= 2;
+      }
+
+      if (ix->offsets == NULL) {
+        printf("Out of memory or other null pointer error while building String char index\n");
+        abort();
+      }
+
+      ix->offsets[ix->count ++] = offset;
+    }
+  }
+
+  /* Walk to a grapheme index in a String from the closest char_index entry, extending the char_index first if asked,
+   * and get the number of graphemes left to walk when the end came first (offset is then where the walk stopped) */
+  static
+  size_t __char_index_walk (String const& s, size_t index, size_t& offset, bool extend) {
+    size_t remaining = index;
+    offset = 0;
+
+    if (s.byte_length >= String::CHAR_INDEX_THRESHOLD) {
+      size_t entry = index / String::CHAR_INDEX_STRIDE;
+
+      if (extend) __char_index_extend(s, entry);
+
+      CharIndex* ix = s.char_index;
+
+      if (ix != NULL && ix->count > 0) {
+        if (entry >= ix->count) entry = ix->count - 1;
+
+        offset = ix->offsets[entry];
+        remaining = index - entry * String::CHAR_INDEX_STRIDE;
+      }
+    }
+
+    for (; remaining > 0; -- remaining) {
+      if (offset >= s.byte_length || s.bytes[offset] == '\0') break;
+      offset += __lead_size(s.bytes[offset]);
+    }
+
+    return remaining;
+  }
+
+  /* Find where a grapheme index starts in a String, false if the index is at or past the end (offset is then the end) */
+  static
+  bool __char_index_seek (String const& s, size_t index, size_t& offset) {
+    return __char_index_walk(s, index, offset, true) == 0 && offset < s.byte_length && s.bytes[offset] != '\0';
+  }
+
+  /* Drop the char_index entries a mutation at a grapheme index invalidates (Those before it keep their offsets) */
+  static
+  void __char_index_truncate (String const& s, size_t index) {
+    CharIndex* ix = s.char_index;
+    if (ix == NULL) return;
+
+    size_t keep = index / String::CHAR_INDEX_STRIDE + 1;
+    if (ix->count > keep) ix->count = keep;
+
+    ix->complete = false;
+  }
+
+  /* Note that a String grew at the end, its char_index stays valid but may be extended further */
+  static
+  void __char_index_append (String const& s) {
+    if (s.char_index != NULL) s.char_index->complete = false;
+  }
+
+  /* Adjust the cached char_length of a String for graphemes added or removed */
+  static inline
+  void __char_length_add (String const& s, size_t added, size_t removed = 0) {
+    if (s.char_length != String::UNKNOWN_LENGTH) s.char_length = s.char_length + added - removed;
+  }
+
+  /* Check that a char_size walk over a String steps onto a byte offset (The walk lands within 3 bytes before it, so no lead
+   * there may reach past it, and a stray continuation byte is a step of 1) */
+  static inline
+  bool __walk_lands_on (String const& s, size_t offset) {
+    for (size_t j = offset > 3? offset - 3 : 0; j < offset; ++ j) {
+      if (j + __lead_size(s.bytes[j]) > offset) return false;
+    }
+
+    return true;
+  }
+
+  /* Count the graphemes in a segment just written into a String at a byte offset, skipped while the count is unknown anyway
+   * (A count is only additive when the segment is well formed and the bytes before it end on a whole sequence, as a truncated
+   * lead would otherwise step into the segment, and a recount ends at the first NUL, so a segment holding one makes it unknown too) */
+  static inline
+  size_t __char_length_of (String const& s, size_t offset, size_t length) {
+    if (s.char_length == String::UNKNOWN_LENGTH) return 0;
+
+    uint8_t const* seg = s.bytes + offset;
+
+    if (memchr(seg, 0, length) != NULL || !__walk_lands_on(s, offset) || !is_valid(seg, length)) {
+      s.char_length = String::UNKNOWN_LENGTH;
+      return 0;
+    }
+
+    return utf32_length(seg, length);
+  }
+
+  size_t String::byte_offset (size_t index) {
+    size_t offset;
+
+    // past the end, let the plain walk report it the same way it always has
+    if (__char_index_walk(*this, index, offset, true) > 0) return utf8::byte_offset(bytes, index);
+
+    return offset;
+  }
+
+  size_t String::byte_offset (size_t index) const {
+    size_t offset;
+
+    // a const String may be read from several threads, so it only uses the char_index that is already there
+    if (__char_index_walk(*this, index, offset, false) > 0) return utf8::byte_offset(bytes, index);
+
+    return offset;
+  }
+
+  void String::build_char_index () {
+    if (byte_length >= CHAR_INDEX_THRESHOLD) __char_index_extend(*this, SIZE_MAX);
+  }
+
+  void String::clear_char_index () const {
+    if (char_index != NULL) {
+      if (char_index->offsets != NULL) __deallocate(allocator, char_index->offsets, char_index->capacity * sizeof(size_t));
+      __deallocate(allocator, char_index, sizeof(CharIndex));
+      char_index = NULL;
+    }
+  }
+
+
+  void String::dispose () {
+    clear_char_index();
+
+    if (bytes != NULL) {
+      if (shared != NULL) __shared_release(shared);
+      else if (!is_inline()) __deallocate(allocator, bytes, byte_capacity);
+      bytes = NULL;
+    }
+
+    shared = NULL;
+
+    byte_length = 0;
+    byte_capacity = 0;
+    char_length = 0;
+  }
+
+  uint8_t* String::release () {
+    collapse_allocation();
+
+    uint8_t* p = bytes;
+
+    // the caller owns the result, so inline and shared data has to be copied out to an allocation of its own
+    if (is_inline() || shared != NULL) {
+      p = (uint8_t*) __allocate(allocator, byte_length + 1);
+
+      if (p == NULL) {
+        printf("Out of memory or other null pointer error while releasing String allocation\n");
+        abort();
+      }
+
+      memcpy(p, bytes, byte_length + 1);
+    } else {
+      bytes = NULL;
+    }
+
+    dispose();
+
+    return p;
+  }
+
+  void String::move (String& source) {
+    if (&source == this) return;
+
+    dispose();
+    allocator = source.allocator;
+    bytes = source.bytes;
+    byte_length = source.byte_length;
+    byte_capacity = source.byte_capacity;
+    char_length = source.char_length;
+    char_index = source.char_index;
+    shared = source.shared;
+
+    if (source.is_inline()) {
+      memcpy(inline_bytes, source.inline_bytes, INLINE_CAPACITY);
+      bytes = inline_bytes;
+    }
+
+    source.bytes = NULL;
+    source.char_index = NULL;
+    source.shared = NULL;
+    source.dispose();
+  }
+
+  void String::assign (String const& src) {
+    if (&src == this) return;
+
+    dispose();
+
+    if (src.shared != NULL) {
+      src.shared->references.fetch_add(1, std::memory_order_relaxed);
+      shared = src.shared;
+      bytes = src.bytes;
+      byte_length = src.byte_length;
+      byte_capacity = src.byte_capacity;
+    } else if (src.bytes != NULL) {
+      char_length = UNKNOWN_LENGTH;
+      insert(src.bytes, src.byte_length);
+    }
+
+    char_length = src.char_length;
+  }
+
+
+  void String::share () {
+    if (shared != NULL || bytes == NULL || is_inline()) return;
+
+    SharedBuffer* buffer = (SharedBuffer*) __allocate(allocator, sizeof(SharedBuffer) + byte_length + 1);
+
+    if (buffer == NULL) {
+      printf("Out of memory or other null pointer error while sharing String allocation\n");
+      abort();
+    }
+
+    new (buffer) SharedBuffer;
+    buffer->references.store(1, std::memory_order_relaxed);
+    buffer->allocator = allocator;
+    buffer->capacity = byte_length + 1;
+
+    memcpy(__shared_bytes(buffer), bytes, byte_length + 1);
+    __deallocate(allocator, bytes, byte_capacity);
+
+    bytes = __shared_bytes(buffer);
+    byte_capacity = byte_length + 1;
+    shared = buffer;
+  }
+
+  void String::unshare () {
+    if (shared != NULL) grow_allocation(0);
+  }
+
+
+  /* Bytes requested per read while loading an input whose size isn't known */
+  static constexpr
+  size_t __READ_CHUNK = 64 * 1024;
+
+  /* Get the size of the file behind a stream, false if it isn't a regular file (Pipes, terminals and so on) */
+  static
+  bool __stream_size (FILE* f, size_t& size) {
+    #ifdef _WIN32
+      struct _stat64 info;
+      if (_fstat64(_fileno(f), &info) != 0 || (info.st_mode & _S_IFMT) != _S_IFREG) return false;
+    #else
+      struct stat info;
+      if (fstat(fileno(f), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+    #endif
+
+    size = (size_t) info.st_size;
+
+    return true;
+  }
+
+  /* Append everything left in a stream to a String a chunk at a time, aborting on read errors */
+  static
+  void __read_chunks (FILE* f, String& out, char const* name) {
+    for (;;) {
+      out.grow_allocation(__READ_CHUNK);
+
+      size_t read = fread(out.bytes + out.byte_length, 1, __READ_CHUNK, f);
+      out.byte_length += read;
+
+      if (read < __READ_CHUNK) break;
+    }
+
+    if (ferror(f)) {
+      printf("Error reading file \"%s\"\n", name);
+      abort();
+    }
+
+    out.bytes[out.byte_length] = 0;
+  }
+
+  /* Read the rest of a stream into a String, in one read when the size is known up front */
+  static
+  void __read_stream (FILE* f, String& out, char const* name) {
+    size_t size;
+
+    if (__stream_size(f, size) && size > 0) {
+      out.grow_allocation(size);
+      out.byte_length = fread(out.bytes, 1, size, f);
+      out.bytes[out.byte_length] = 0;
+
+      if (ferror(f)) {
+        printf("Error reading file \"%s\"\n", name);
+        abort();
+      }
+
+      // files can report a size that is wrong by the time they are read, or 0 for generated ones like /proc
+      int c = fgetc(f);
+      if (c == EOF) return;
+      ungetc(c, f);
+    }
+
+    __read_chunks(f, out, name);
+  }
+
+
+  String String::from_file (char const* file_name, Allocator const* allocator) {
+    FILE* f;
+
+    #ifdef _WIN32
+      f = NULL;
+      fopen_s(&f, file_name, "rb");
+    #else
+      f = fopen(file_name, "rb");
+    #endif
+
+    if (f == NULL) {
+      printf("Error reading file \"%s\"\n", file_name);
+      abort();
+    }
+
+    String out { allocator };
+
+    __read_stream(f, out, file_name);
+
+    fclose(f);
+
+    out.char_length = UNKNOWN_LENGTH;
+
+    return out;
+  }
+
+
+  void String::to_file (char const* file_name) const {
+    FILE* f;
+
+    #ifdef _WIN32
+      f = NULL;
+      fopen_s(&f, file_name, "wb");
+    #else
+      f = fopen(file_name, "wb");
+    #endif
+
+    if (f == NULL) {
+      printf("Error writing file \"%s\"\n", file_name);
+      abort();
+    }
+
+    bool written = fwrite(bytes, 1, byte_length, f) == byte_length;
+
+    if (fclose(f) != 0 || !written) {
+      printf("Error writing file \"%s\"\n", file_name);
+      abort();
+    }
+  }
+
+
+  void String::collapse_allocation () {
+    if (is_inline() || shared != NULL) return;
+
+    if (byte_capacity > byte_length + 1) {
+      bytes = (uint8_t*) __reallocate(allocator, bytes, byte_capacity, byte_length + 1);
+      byte_capacity = byte_length + 1;
+    }
+  }
+
+  void String::grow_allocation (size_t additional_length) {
     size_t required_capacity = byte_length + additional_length + 1;
 
-    size_t new_capacity = byte_capacity > 0? byte_capacity : DEFAULT_CAPACITY;
+    if (bytes == NULL && required_capacity <= INLINE_CAPACITY) {
+      bytes = inline_bytes;
+      bytes[0] = 0;
+      byte_capacity = INLINE_CAPACITY;
+      return;
+    }
+
+    // a SharedBuffer is never written, so growing it means copying into a buffer of this String's own
+    if (shared != NULL) {
+      SharedBuffer* buffer = shared;
+      uint8_t* old_bytes = bytes;
+
+      shared = NULL;
+      bytes = NULL;
+      byte_capacity = 0;
+
+      if (required_capacity <= INLINE_CAPACITY) {
+        bytes = inline_bytes;
+        byte_capacity = INLINE_CAPACITY;
+      } else {
+        grow_allocation(additional_length);
+      }
+
+      memcpy(bytes, old_bytes, byte_length + 1);
+      __shared_release(buffer);
+
+      return;
+    }
+
+    size_t new_capacity = byte_capacity > 0? byte_capacity : DEFAULT_CAPACITY;
+
+    while (new_capacity < required_capacity) new_capacity *= 2;
+
+    if (new_capacity > byte_capacity) {
+      if (bytes == NULL) {
+        bytes = (uint8_t*) __allocate(allocator, new_capacity);
+        if (bytes != NULL) bytes[0] = 0;
+      }
+      else if (is_inline()) {
+        bytes = (uint8_t*) __allocate(allocator, new_capacity);
+        if (bytes != NULL) memcpy(bytes, inline_bytes, byte_length + 1);
+      }
+      else bytes = (uint8_t*) __reallocate(allocator, bytes, byte_capacity, new_capacity);
+
+      byte_capacity = new_capacity;
+
+      if (bytes == NULL) {
+        printf("Out of memory or other null pointer error while growing String allocation\n");
+        abort();
+      }
+    }
+  }
+
+
+  void String::insert (uint8_t const* str, size_t length) {
+    if (length == 0) length = utf8::byte_count(str);
+
+    grow_allocation(length);
+
+    memcpy(bytes + byte_length, str, length);
+
+    __char_length_add(*this, __char_length_of(*this, byte_length, length));
+
+    byte_length += length;
+
+    bytes[byte_length] = 0;
+
+    __char_index_append(*this);
+  }
+
+  void String::insert (char const* str, size_t length) {
+    insert((uint8_t const*) str, length);
+  }
+
+  void String::insert (int32_t c) {
+    size_t length = utf8::char_size(c);
+
+    grow_allocation(length);
+
+    if (length == 1) {
+      bytes[byte_length ++] = c;
+    } else if (length == 2) {
+      bytes[byte_length ++] = 192 + (c >> 6);
+      bytes[byte_length ++] = 128 + (c & 63);
+    } else if (length == 3) {
+      bytes[byte_length ++] = 224 + (c >> 12);
+      bytes[byte_length ++] = 128 + ((c >> 6) & 63);
+      bytes[byte_length ++] = 128 + (c & 63);
+    } else if (length == 4) {
+      bytes[byte_length ++] = 240 + (c >> 18);
+      bytes[byte_length ++] = 128 + ((c >> 12) & 63);
+      bytes[byte_length ++] = 128 + ((c >> 6) & 63);
+      bytes[byte_length ++] = 128 + (c & 63);
+    }
+
+    bytes[byte_length] = 0;
+
+    __char_length_add(*this, __char_length_of(*this, byte_length - length, length));
+    __char_index_append(*this);
+  }
+
+
+  void String::insert_at (size_t index, uint8_t const* seg, size_t length) {
+    size_t offset;
+
+    if (index >= char_length || !__char_index_seek(*this, index, offset)) return insert(seg, length);
+
+    if (length == 0) length = utf8::byte_count(seg);
+
+    grow_allocation(length);
+
+    __shift_bytes(bytes + offset + length, bytes + offset, byte_length - offset);
+
+    memcpy(bytes + offset, seg, length);
+
+    __char_length_add(*this, __char_length_of(*this, offset, length));
+
+    byte_length += length;
+    bytes[byte_length] = 0;
+
+    __char_index_truncate(*this, index);
+  }
+
+  void String::insert_at (size_t index, char const* str, size_t length) {
+    insert_at(index, (uint8_t const*) str, length);
+  }
+
+  void String::insert_at (size_t index, int32_t c) {
+    size_t offset;
+
+    if (index >= char_length || !__char_index_seek(*this, index, offset)) return insert(c);
+
+    size_t length = utf8::char_size(c);
+
+    grow_allocation(length);
+
+    __shift_bytes(bytes + offset + length, bytes + offset, byte_length - offset);
+
+    if (length == 1) {
+      bytes[offset] = c;
+    } else if (length == 2) {
+      bytes[offset + 0] = 192 + (c >> 6);
+      bytes[offset + 1] = 128 + (c & 63);
+    } else if (length == 3) {
+      bytes[offset + 0] = 224 + (c >> 12);
+      bytes[offset + 1] = 128 + ((c >> 6) & 63);
+      bytes[offset + 2] = 128 + (c & 63);
+    } else if (length == 4) {
+      bytes[offset + 0] = 240 + (c >> 18);
+      bytes[offset + 1] = 128 + ((c >> 12) & 63);
+      bytes[offset + 2] = 128 + ((c >> 6) & 63);
+      bytes[offset + 3] = 128 + (c & 63);
+    }
+
+    byte_length += length;
+    bytes[byte_length] = 0;
+
+    __char_length_add(*this, __char_length_of(*this, offset, length));
+    __char_index_truncate(*this, index);
+  }
+
+
+  void String::remove (size_t index, size_t count) {
+    unshare();
+
+    size_t base = byte_offset(index);
+    size_t end = byte_offset(index + count);
+
+    __shift_bytes(bytes + base, bytes + end, byte_length - end);
+
+    byte_length -= end - base;
+    bytes[byte_length] = 0;
+
+    __char_length_add(*this, 0, count);
+    __char_index_truncate(*this, index);
+  }
+
+
+  void String::insert_fmt_va (uint8_t const* fmt, va_list args) {
+    va_list args_b;
+
+    va_copy(args_b, args);
+
+    int length = vsnprintf(NULL, 0, (char const*) fmt, args_b);
+    UTF8_STAT(format_passes, 1);
+
+    va_end(args_b);
+
+    grow_allocation(length);
+
+    vsnprintf((char*) bytes + byte_length, length + 1, (char const*) fmt, args);
+    UTF8_STAT(format_passes, 1);
+
+    __char_length_add(*this, __char_length_of(*this, byte_length, length));
+
+    byte_length += length;
+    bytes[byte_length] = 0;
+
+    __char_index_append(*this);
+  }
+
+  void String::insert_fmt_va (char const* fmt, va_list args) {
+    insert_fmt_va((uint8_t const*) fmt, args);
+  }
+
+  void String::insert_fmt (uint8_t const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    insert_fmt_va(fmt, args);
+    va_end(args);
+  }
+
+  void String::insert_fmt (char const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    insert_fmt_va(fmt, args);
+    va_end(args);
+  }
+
+
+  void String::insert_fmt_at_va (size_t index, uint8_t const* fmt, va_list args) {
+    size_t offset;
+
+    if (index >= char_length || !__char_index_seek(*this, index, offset)) return insert_fmt_va(fmt, args);
+
+    va_list args_b;
+
+    va_copy(args_b, args);
+
+    int length = vsnprintf(NULL, 0, (char const*) fmt, args_b);
+    UTF8_STAT(format_passes, 1);
+
+    va_end(args_b);
+
+    grow_allocation(length + 1);
+
+    uint8_t* ptr = bytes + offset;
+
+    uint8_t* dest = ptr + length + 1;
+    uint8_t* dest1 = dest - 1;
+    size_t move_length = byte_length - offset;
+    __shift_bytes(dest, ptr, move_length); // this double move really sucks but vsnprintf writes a null terminator
+
+    vsnprintf((char*) ptr, length + 1, (char const*) fmt, args);
+    UTF8_STAT(format_passes, 1);
+    __shift_bytes(dest1, dest, move_length);
+
+    __char_length_add(*this, __char_length_of(*this, offset, length));
+
+    byte_length += length;
+    bytes[byte_length] = 0;
+
+    __char_index_truncate(*this, index);
+  }
+
+  void String::insert_fmt_at_va (size_t index, char const* fmt, va_list args) {
+    insert_fmt_at_va(index, (uint8_t const*) fmt, args);
+  }
+
+  void String::insert_fmt_at (size_t index, uint8_t const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    insert_fmt_at_va(index, fmt, args);
+    va_end(args);
+  }
+
+  void String::insert_fmt_at (size_t index, char const* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    insert_fmt_at_va(index, fmt, args);
+    va_end(args);
+  }
+
+
+  /* Create a case converted copy of a String, sized on the first try unless a conversion grows the text */
+  static
+  String __case_copy (String const& s, __CaseTable const& table, bool upper) {
+    String out { s.allocator, s.byte_length };
+
+    size_t length = __case_convert(table, upper, s.bytes, s.byte_length, out.bytes, out.byte_capacity - 1);
+
+    if (length > out.byte_capacity - 1) {
+      out.grow_allocation(length);
+      __case_convert(table, upper, s.bytes, s.byte_length, out.bytes, length);
+    }
+
+    out.byte_length = length;
+    out.bytes[length] = 0;
+    out.char_length = s.char_length;
+
+    return out;
+  }
+
+  /* Case convert a String in place, splicing in an out of place conversion of the rest from where the byte size first changes */
+  static
+  void __case_string_in_place (String& s, __CaseTable const& table, bool upper) {
+    if (s.byte_length == 0) return;
+
+    s.unshare();
+
+    size_t stop = __case_in_place(table, upper, s.bytes, s.byte_length);
+
+    if (stop == s.byte_length) return;
+
+    size_t rest = s.byte_length - stop;
+    size_t length = __case_convert(table, upper, s.bytes + stop, rest, NULL, 0);
+
+    String tail { s.allocator, length };
+    __case_convert(table, upper, s.bytes + stop, rest, tail.bytes, length);
+
+    s.byte_length = stop;
+    s.grow_allocation(length);
+    memcpy(s.bytes + stop, tail.bytes, length);
+    s.byte_length += length;
+    s.bytes[s.byte_length] = 0;
+
+    s.clear_char_index();
+  }
+
+
+  String String::to_lowercase () const {
+    return __case_copy(*this, __lowercase_table(), false);
+  }
+
+  String String::to_uppercase () const {
+    return __case_copy(*this, __uppercase_table(), true);
+  }
+
+  void String::make_lowercase () {
+    __case_string_in_place(*this, __lowercase_table(), false);
+  }
+
+  void String::make_uppercase () {
+    __case_string_in_place(*this, __uppercase_table(), true);
+  }
+
+  // utf8proc totitle is broken
+  // String String::to_titlecase () const {
+  //   String out { byte_length };
+
+  //   for (auto [ i, c ] : *this) out.insert(utf8proc_totitle(c));
+
+  //   return out;
+  // }
+
+  String String::casefold () const {
+    uint8_t* new_bytes = utf8proc_NFKC_Casefold(bytes);
+
+    size_t new_length = utf8::byte_count(new_bytes);
+
+    // utf8proc always mallocs, so the result is only adopted when it would have come from malloc anyway
+    if (new_length < INLINE_CAPACITY || allocator != NULL) {
+      String out { allocator, new_length };
+      out.insert(new_bytes, new_length);
+      free(new_bytes);
+      return out;
+    }
+
+    size_t new_capacity = DEFAULT_CAPACITY;
+    while (new_capacity < new_length) new_capacity *= 2;
+
+    if (new_capacity > new_length) new_bytes = (uint8_t*) realloc(new_bytes, new_capacity);
+
+    return { new_bytes, new_length, new_capacity };
+  }
+
+  void String::normalize (NormalForm form) {
+    String out { allocator };
+
+    if (utf8::normalize(StringView { *this }, form, out).bytes != bytes) move(out);
+  }
+
+
+
+  /* Decode the grapheme at c the way to_int does, or U+FFFD if its sequence needs more than the available bytes */
+  static inline
+  int32_t __to_int_bounded (uint8_t const* c, size_t available) {
+    return __lead_size(*c) <= available? utf8::to_int(c) : 0xFFFD;
+  }
+
+  /* Step a byte offset in a segment forward by up to count graphemes, returning how many were left over at the end */
+  static inline
+  size_t __view_advance (uint8_t const* bytes, size_t byte_length, size_t& offset, size_t count) {
+    while (count > 0 && offset < byte_length) {
+      offset += __lead_size(bytes[offset]);
+      -- count;
+    }
+
+    if (offset > byte_length) offset = byte_length;
+
+    return count;
+  }
+
+
+  String::String (StringView src) {
+    if (src.byte_length > 0) insert(src.bytes, src.byte_length);
+  }
+
+
+  StringIteratorResult StringViewIterator::operator * () const {
+    return { index, __to_int_bounded(bytes, limit - bytes) };
+  }
+
+  StringViewIterator& StringViewIterator::operator ++ () {
+    index ++;
+    bytes += __lead_size(*bytes);
+    return *this;
+  }
+
+  bool StringViewIterator::operator != (StringViewIterator const& other) const {
+    return bytes < other.bytes;
+  }
+
+
+  int32_t StringView::char_at (size_t index) const {
+    size_t offset = 0;
+
+    if (__view_advance(bytes, byte_length, offset, index) > 0 || offset == byte_length) return 0;
+
+    return __to_int_bounded(bytes + offset, byte_length - offset);
+  }
+
+  size_t StringView::byte_offset (size_t index) const {
+    size_t offset = 0;
+    __view_advance(bytes, byte_length, offset, index);
+    return offset;
+  }
+
+  StringView StringView::slice (size_t start, size_t end) const {
+    if (end < start) end = start;
+
+    size_t base = 0;
+    __view_advance(bytes, byte_length, base, start);
+
+    size_t limit = base;
+    __view_advance(bytes, byte_length, limit, end - start);
+
+    return { bytes + base, limit - base };
+  }
+
+  int StringView::compare (StringView const& other) const {
+    size_t shared_length = byte_length < other.byte_length? byte_length : other.byte_length;
+
+    int order = shared_length > 0? memcmp(bytes, other.bytes, shared_length) : 0;
+    if (order != 0) return order;
+
+    return byte_length < other.byte_length? -1 : byte_length > other.byte_length? 1 : 0;
+  }
+
+
+  extern
+  size_t char_count (StringView view) {
+    return __char_count(view.bytes, view.byte_length, false);
+  }
+
+  extern
+  size_t column_count (StringView view) {
+    return __column_count(view.bytes, view.byte_length, false);
+  }
+
+
+  #ifdef UTF8_X86
+    /* Find the first candidate at or after offset whose first and last bytes match a needle, a vector of candidates at a time,
+     * then compare the bytes between them. Stops at the last full vector, leaving offset where the rest should be searched */
+    static
+    size_t __find_sse2 (uint8_t const* haystack, size_t haystack_length, uint8_t const* needle, size_t needle_length, size_t& offset) {
+      __m128i const first = _mm_set1_epi8((char) needle[0]);
+      __m128i const last = _mm_set1_epi8((char) needle[needle_length - 1]);
+
+      for (; haystack_length - offset >= needle_length - 1 + 16; offset += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const*) (haystack + offset));
+        __m128i b = _mm_loadu_si128((__m128i const*) (haystack + offset + needle_length - 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        for (; mask != 0; mask &= mask - 1) {
+          size_t candidate = offset + __trailing_zeros(mask);
+          if (needle_length <= 2 || memcmp(haystack + candidate + 1, needle + 1, needle_length - 2) == 0) return candidate;
+        }
+      }
+
+      return Match::NOT_FOUND;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __find_avx2 (uint8_t const* haystack, size_t haystack_length, uint8_t const* needle, size_t needle_length, size_t& offset) {
+      __m256i const first = _mm256_set1_epi8((char) needle[0]);
+      __m256i const last = _mm256_set1_epi8((char) needle[needle_length - 1]);
+
+      for (; haystack_length - offset >= needle_length - 1 + 32; offset += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const*) (haystack + offset));
+        __m256i b = _mm256_loadu_si256((__m256i const*) (haystack + offset + needle_length - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        for (; mask != 0; mask &= mask - 1) {
+          size_t candidate = offset + __trailing_zeros(mask);
+          if (needle_length <= 2 || memcmp(haystack + candidate + 1, needle + 1, needle_length - 2) == 0) return candidate;
+        }
+      }
+
+      return Match::NOT_FOUND;
+    }
+
+    /* Find the last candidate before end like __find_sse2 does the first, moving end back to where the rest should be searched */
+    static
+    size_t __rfind_sse2 (uint8_t const* haystack, uint8_t const* needle, size_t needle_length, size_t& end) {
+      __m128i const first = _mm_set1_epi8((char) needle[0]);
+      __m128i const last = _mm_set1_epi8((char) needle[needle_length - 1]);
+
+      for (; end >= 16; end -= 16) {
+        size_t offset = end - 16;
+        __m128i a = _mm_loadu_si128((__m128i const*) (haystack + offset));
+        __m128i b = _mm_loadu_si128((__m128i const*) (haystack + offset + needle_length - 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask != 0) {
+          unsigned i = __highest_bit(mask);
+          if (needle_length <= 2 || memcmp(haystack + offset + i + 1, needle + 1, needle_length - 2) == 0) return offset + i;
+          mask &= ~(1u << i);
+        }
+      }
+
+      return Match::NOT_FOUND;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __rfind_avx2 (uint8_t const* haystack, uint8_t const* needle, size_t needle_length, size_t& end) {
+      __m256i const first = _mm256_set1_epi8((char) needle[0]);
+      __m256i const last = _mm256_set1_epi8((char) needle[needle_length - 1]);
+
+      for (; end >= 32; end -= 32) {
+        size_t offset = end - 32;
+        __m256i a = _mm256_loadu_si256((__m256i const*) (haystack + offset));
+        __m256i b = _mm256_loadu_si256((__m256i const*) (haystack + offset + needle_length - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        while (mask != 0) {
+          unsigned i = __highest_bit(mask);
+          if (needle_length <= 2 || memcmp(haystack + offset + i + 1, needle + 1, needle_length - 2) == 0) return offset + i;
+          mask &= ~(1u << i);
+        }
+      }
+
+      return Match::NOT_FOUND;
+    }
+  #endif
+
+  /* Get the byte offset of the first occurrence of a needle in a segment at or after an offset, or Match::NOT_FOUND */
+  static
+  size_t __find (uint8_t const* haystack, size_t haystack_length, uint8_t const* needle, size_t needle_length, size_t offset) {
+    if (needle_length == 0) return offset <= haystack_length? offset : Match::NOT_FOUND;
+    if (needle_length > haystack_length || offset > haystack_length - needle_length) return Match::NOT_FOUND;
+
+    // libc already vectorizes a single byte search
+    if (needle_length == 1) {
+      uint8_t const* found = (uint8_t const*) memchr(haystack + offset, needle[0], haystack_length - offset);
+      return found != NULL? (size_t) (found - haystack) : Match::NOT_FOUND;
+    }
+
+    size_t match = Match::NOT_FOUND;
+
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: match = __find_avx2(haystack, haystack_length, needle, needle_length, offset); break;
+        case SimdLevel::SSE2: match = __find_sse2(haystack, haystack_length, needle, needle_length, offset); break;
+      #endif
+      default: break;
+    }
+
+    if (match != Match::NOT_FOUND) return match;
+
+    size_t last = haystack_length - needle_length;
+
+    while (offset <= last) {
+      uint8_t const* candidate = (uint8_t const*) memchr(haystack + offset, needle[0], last - offset + 1);
+      if (candidate == NULL) break;
+
+      offset = candidate - haystack;
+
+      if (haystack[offset + needle_length - 1] == needle[needle_length - 1] && memcmp(candidate + 1, needle + 1, needle_length - 2) == 0) return offset;
+
+      ++ offset;
+    }
+
+    return Match::NOT_FOUND;
+  }
+
+  /* Get the byte offset of the last occurrence of a needle in a segment, or Match::NOT_FOUND */
+  static
+  size_t __rfind (uint8_t const* haystack, size_t haystack_length, uint8_t const* needle, size_t needle_length) {
+    if (needle_length > haystack_length) return Match::NOT_FOUND;
+    if (needle_length == 0) return haystack_length;
+
+    size_t end = haystack_length - needle_length + 1; // Candidates start before this
+    size_t match = Match::NOT_FOUND;
+
+    switch (__active_simd_level()) {
+      #ifdef UTF8_X86
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: match = __rfind_avx2(haystack, needle, needle_length, end); break;
+        case SimdLevel::SSE2: match = __rfind_sse2(haystack, needle, needle_length, end); break;
+      #endif
+      default: break;
+    }
+
+    if (match != Match::NOT_FOUND) return match;
+
+    while (end > 0) {
+      -- end;
+      if (haystack[end] == needle[0] && memcmp(haystack + end, needle, needle_length) == 0) return end;
+    }
+
+    return Match::NOT_FOUND;
+  }
+
+  /* Copy a piece of a replace_all result into a buffer, as far as it fits (The piece may overlap it, when compacting in place) */
+  static inline
+  void __replace_put (uint8_t* dst, size_t capacity, size_t& length, uint8_t const* piece, size_t piece_length) {
+    if (length < capacity) memmove(dst + length, piece, piece_length < capacity - length? piece_length : capacity - length);
+    length += piece_length;
+  }
+
+  /* Write a segment into a buffer with each non overlapping occurrence of a needle replaced, returning the length of the whole result
+   * and the number of replacements (Whatever got cut off at capacity is left partially written) */
+  static
+  size_t __replace_all (uint8_t const* src, size_t src_length, StringView needle, StringView replacement, uint8_t* dst, size_t capacity, size_t& count) {
+    size_t length = 0;
+    size_t offset = 0;
+    size_t match;
+
+    count = 0;
+
+    if (needle.byte_length > 0) {
+      while ((match = __find(src, src_length, needle.bytes, needle.byte_length, offset)) != Match::NOT_FOUND) {
+        __replace_put(dst, capacity, length, src + offset, match - offset);
+        __replace_put(dst, capacity, length, replacement.bytes, replacement.byte_length);
+        offset = match + needle.byte_length;
+        ++ count;
+      }
+    }
+
+    __replace_put(dst, capacity, length, src + offset, src_length - offset);
+
+    return length;
+  }
+
+  extern
+  Match find (StringView haystack, StringView needle, size_t from) {
+    size_t match = __find(haystack.bytes, haystack.byte_length, needle.bytes, needle.byte_length, from);
+    if (match == Match::NOT_FOUND) return { };
+    return { match, __char_count(haystack.bytes, match, false) };
+  }
+
+  extern
+  Match rfind (StringView haystack, StringView needle) {
+    size_t match = __rfind(haystack.bytes, haystack.byte_length, needle.bytes, needle.byte_length);
+    if (match == Match::NOT_FOUND) return { };
+    return { match, __char_count(haystack.bytes, match, false) };
+  }
+
+  extern
+  bool contains (StringView haystack, StringView needle) {
+    return __find(haystack.bytes, haystack.byte_length, needle.bytes, needle.byte_length, 0) != Match::NOT_FOUND;
+  }
+
+  extern
+  size_t count_occurrences (StringView haystack, StringView needle) {
+    if (needle.byte_length == 0) return 0;
+
+    size_t count = 0;
+    size_t offset = 0;
+    size_t match;
+
+    while ((match = __find(haystack.bytes, haystack.byte_length, needle.bytes, needle.byte_length, offset)) != Match::NOT_FOUND) {
+      offset = match + needle.byte_length;
+      ++ count;
+    }
+
+    return count;
+  }
+
+  extern
+  size_t replace_all (StringView src, StringView needle, StringView replacement, uint8_t* dst, size_t capacity) {
+    size_t count;
+    size_t length = __replace_all(src.bytes, src.byte_length, needle, replacement, dst, capacity, count);
+
+    // clear the sequence the end of the buffer cut short, if any
+    if (length > capacity && capacity > 0) {
+      size_t start = capacity - 1;
+      while (start > 0 && (dst[start] & 0xC0) == 0x80) -- start;
+      if (start + __lead_size(dst[start]) > capacity) memset(dst + start, 0, capacity - start);
+    }
+
+    return length;
+  }
+
+
+  Match String::find (StringView needle, size_t from_index) const {
+    size_t from = byte_offset(from_index);
+    size_t match = __find(bytes, byte_length, needle.bytes, needle.byte_length, from);
+
+    if (match == Match::NOT_FOUND) return { };
+
+    return { match, from_index + __char_count(bytes + from, match - from, false) };
+  }
+
+  Match String::rfind (StringView needle) const {
+    size_t match = __rfind(bytes, byte_length, needle.bytes, needle.byte_length);
+
+    if (match == Match::NOT_FOUND) return { };
+
+    if (char_length != UNKNOWN_LENGTH) return { match, char_length - __char_count(bytes + match, byte_length - match, false) };
+
+    return { match, __char_count(bytes, match, false) };
+  }
+
+  bool String::contains (StringView needle) const {
+    return utf8::contains(StringView { *this }, needle);
+  }
+
+  size_t String::count_occurrences (StringView needle) const {
+    return utf8::count_occurrences(StringView { *this }, needle);
+  }
+
+  size_t String::replace_all (StringView needle, StringView replacement) {
+    if (needle.byte_length == 0 || byte_length < needle.byte_length) return 0;
+
+    // either argument may point into this String, which an in place pass would overwrite before reading
+    auto inside = [&] (StringView v) { return v.bytes < bytes + byte_capacity && v.bytes + v.byte_length > bytes; };
+
+    // counted up front for the same reason, the arguments may be gone once the result moves in, and only patched into the count
+    // when everything is well formed, as a char_size walk over malformed bytes doesn't add up across the seams of a replacement
+    bool well_formed = char_length != UNKNOWN_LENGTH && is_valid(needle.bytes, needle.byte_length)
+                    && is_valid(replacement.bytes, replacement.byte_length) && is_valid(bytes, byte_length);
+    size_t needle_chars = well_formed? utf8::char_count(needle) : 0;
+    size_t replacement_chars = well_formed? utf8::char_count(replacement) : 0;
+    bool replacement_nul = replacement.byte_length != 0 && memchr(replacement.bytes, 0, replacement.byte_length) != NULL;
+    size_t count;
+
+    if (replacement.byte_length <= needle.byte_length && shared == NULL && !inside(needle) && !inside(replacement)) {
+      // the result never outgrows what it has been written from, so it is compacted forward as the occurrences are found
+      size_t length = __replace_all(bytes, byte_length, needle, replacement, bytes, byte_capacity, count);
+      if (count == 0) return 0;
+
+      byte_length = length;
+      bytes[byte_length] = 0;
+    } else {
+      count = utf8::count_occurrences(StringView { *this }, needle);
+      if (count == 0) return 0;
+
+      size_t length = byte_length - count * needle.byte_length + count * replacement.byte_length;
+
+      String out { allocator, length };
+      __replace_all(bytes, byte_length, needle, replacement, out.bytes, length, count);
+
+      out.byte_length = length;
+      out.bytes[length] = 0;
+      out.char_length = char_length;
+
+      move(out);
+    }
+
+    // a NUL written into the String ends its count early, see __char_length_of
+    if (replacement_nul || !well_formed) char_length = UNKNOWN_LENGTH;
+    else char_length = char_length - count * needle_chars + count * replacement_chars;
+
+    clear_char_index();
+
+    return count;
+  }
+
+
+  // Chunks handed to the threads of the parallel functions are at least this long, so each does enough work to pay for itself
+  static constexpr size_t __PARALLEL_MIN_CHUNK = 1 << 20;
+
+  // Chunks per thread, so a thread that falls behind leaves the rest for the others to take
+  static constexpr size_t __PARALLEL_CHUNKS_PER_THREAD = 4;
+
+  static constexpr size_t __PARALLEL_MAX_THREADS = 256;
+
+  /* Get the number of threads to use for some amount of work, 1 when it isn't worth splitting */
+  static
+  size_t __parallel_threads (size_t length, size_t min_chunk, size_t thread_count) {
+    if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 1;
+    if (thread_count > __PARALLEL_MAX_THREADS) thread_count = __PARALLEL_MAX_THREADS;
+
+    size_t most = length / min_chunk;
+
+    return most < 2? 1 : thread_count < most? thread_count : most;
+  }
+
+  /* Run task(i) for every i below task_count, on the calling thread and up to thread_count - 1 more, which claim the next task
+   * as they finish the last (If a thread can't be started the others get through its share) */
+  template <typename Task>
+  static
+  void __parallel_run (size_t task_count, size_t thread_count, Task const& task) {
+    std::atomic<size_t> next { 0 };
+
+    auto work = [&] () {
+      size_t i;
+      while ((i = next.fetch_add(1, std::memory_order_relaxed)) < task_count) task(i);
+    };
+
+    std::thread threads [__PARALLEL_MAX_THREADS];
+    size_t started = 0;
+
+    for (; started + 1 < thread_count && started + 1 < task_count; ++ started) {
+      try {
+        threads[started] = std::thread(work);
+      } catch (...) {
+        break;
+      }
+    }
+
+    work();
+
+    for (size_t i = 0; i < started; ++ i) threads[i].join();
+  }
+
+  /* Move an offset of a segment forward to the next point every serial scan from the start steps onto: a byte that isn't a continuation,
+   * that no lead in the 3 bytes before it would step over (Scans step by __lead_size at most, and never over a byte that isn't a continuation) */
+  static
+  size_t __sync_point (uint8_t const* bytes, size_t byte_length, size_t offset) {
+    for (; offset < byte_length; ++ offset) {
+      if ((bytes[offset] & 0xC0) == 0x80) continue;
+
+      bool stepped_over = false;
+
+      for (size_t k = 1; k <= 3 && k <= offset; ++ k) {
+        if (__lead_size(bytes[offset - k]) > k) stepped_over = true;
+      }
+
+      if (!stepped_over) break;
+    }
+
+    return offset;
+  }
+
+  /* Chunk boundaries of a segment for some number of threads, with chunk i from bounds[i] to bounds[i + 1] (Freed with free) */
+  static
+  size_t* __parallel_chunks (uint8_t const* bytes, size_t byte_length, size_t thread_count, size_t& chunk_count) {
+    chunk_count = thread_count * __PARALLEL_CHUNKS_PER_THREAD;
+    if (chunk_count > byte_length / __PARALLEL_MIN_CHUNK) chunk_count = byte_length / __PARALLEL_MIN_CHUNK;
+
+    size_t* bounds = (size_t*) malloc((chunk_count + 1) * sizeof(size_t));
+
+    if (bounds == NULL) {
+      printf("Out of memory or other null pointer error while splitting utf8 buffer\n");
+      abort();
+    }
+
+    bounds[0] = 0;
+
+    for (size_t i = 1; i < chunk_count; ++ i) {
+      size_t bound = __sync_point(bytes, byte_length, byte_length / chunk_count * i);
+      bounds[i] = bound > bounds[i - 1]? bound : bounds[i - 1];
+    }
+
+    bounds[chunk_count] = byte_length;
+
+    return bounds;
+  }
+
+  /* Sum a count over the chunks of a segment on several threads */
+  template <typename Count>
+  static
+  size_t __parallel_sum (uint8_t const* bytes, size_t byte_length, size_t thread_count, Count const& count) {
+    size_t chunk_count;
+    size_t* bounds = __parallel_chunks(bytes, byte_length, thread_count, chunk_count);
+    size_t* counts = (size_t*) malloc(chunk_count * sizeof(size_t));
+
+    if (counts == NULL) {
+      printf("Out of memory or other null pointer error while splitting utf8 buffer\n");
+      abort();
+    }
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      counts[i] = count(bytes + bounds[i], bounds[i + 1] - bounds[i]);
+    });
+
+    size_t total = 0;
+    for (size_t i = 0; i < chunk_count; ++ i) total += counts[i];
+
+    free(counts);
+    free(bounds);
+
+    return total;
+  }
+
+  extern
+  size_t char_count_parallel (StringView view, size_t thread_count) {
+    thread_count = __parallel_threads(view.byte_length, __PARALLEL_MIN_CHUNK, thread_count);
+
+    if (thread_count == 1) return char_count(view);
+
+    return __parallel_sum(view.bytes, view.byte_length, thread_count, [] (uint8_t const* chunk, size_t length) {
+      return __char_count(chunk, length, false);
+    });
+  }
+
+  extern
+  size_t column_count_parallel (StringView view, size_t thread_count) {
+    thread_count = __parallel_threads(view.byte_length, __PARALLEL_MIN_CHUNK, thread_count);
+
+    if (thread_count == 1) return column_count(view);
+
+    return __parallel_sum(view.bytes, view.byte_length, thread_count, [] (uint8_t const* chunk, size_t length) {
+      return __column_count(chunk, length, false);
+    });
+  }
+
+  extern
+  ValidationResult validate_parallel (uint8_t const* bytes, size_t byte_length, size_t thread_count) {
+    thread_count = __parallel_threads(byte_length, __PARALLEL_MIN_CHUNK, thread_count);
+
+    if (thread_count == 1) return validate(bytes, byte_length);
+
+    size_t chunk_count;
+    size_t* bounds = __parallel_chunks(bytes, byte_length, thread_count, chunk_count);
+    std::atomic<size_t> first_invalid { SIZE_MAX };
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      // chunks after one known to be invalid can't hold the first error
+      if (i > first_invalid.load(std::memory_order_relaxed)) return;
+
+      if (validate(bytes + bounds[i], bounds[i + 1] - bounds[i]).error == ValidationError::None) return;
+
+      size_t seen = first_invalid.load(std::memory_order_relaxed);
+      while (i < seen && !first_invalid.compare_exchange_weak(seen, i, std::memory_order_relaxed)) { }
+    });
+
+    size_t invalid = first_invalid.load();
+    ValidationResult result = { ValidationError::None, byte_length };
+
+    // every chunk before it is well formed, so the scan from its start is in step with the serial one, and it runs on to the
+    // end of the segment so an error at the edge of the chunk is reported as the serial scan sees it
+    if (invalid != SIZE_MAX) {
+      result = validate(bytes + bounds[invalid], byte_length - bounds[invalid]);
+      result.offset += bounds[invalid];
+    }
+
+    free(bounds);
+
+    return result;
+  }
+
+  extern
+  size_t decode_to_utf32_parallel (uint8_t const* src, size_t byte_length, int32_t* dst, size_t thread_count) {
+    thread_count = __parallel_threads(byte_length, __PARALLEL_MIN_CHUNK, thread_count);
+
+    if (thread_count == 1) return decode_to_utf32(src, byte_length, dst);
+
+    size_t chunk_count;
+    size_t* bounds = __parallel_chunks(src, byte_length, thread_count, chunk_count);
+    size_t* starts = (size_t*) malloc((chunk_count + 1) * sizeof(size_t));
+
+    if (starts == NULL) {
+      printf("Out of memory or other null pointer error while splitting utf8 buffer\n");
+      abort();
+    }
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      starts[i + 1] = __char_count(src + bounds[i], bounds[i + 1] - bounds[i], false);
+    });
+
+    starts[0] = 0;
+    for (size_t i = 0; i < chunk_count; ++ i) starts[i + 1] += starts[i];
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      decode_to_utf32(src + bounds[i], bounds[i + 1] - bounds[i], dst + starts[i]);
+    });
+
+    size_t written = starts[chunk_count];
+
+    free(starts);
+    free(bounds);
+
+    return written;
+  }
+
+  extern
+  size_t encode_from_utf32_parallel (int32_t const* src, size_t count, uint8_t* dst, size_t thread_count) {
+    // a utf32 grapheme is 4 bytes, so this splits at the same input size as the utf8 functions
+    thread_count = __parallel_threads(count, __PARALLEL_MIN_CHUNK / 4, thread_count);
+
+    if (thread_count == 1) return encode_from_utf32(src, count, dst);
+
+    // every index is a boundary here, only the output offsets need counting first
+    size_t chunk_count = thread_count * __PARALLEL_CHUNKS_PER_THREAD;
+    if (chunk_count > count / (__PARALLEL_MIN_CHUNK / 4)) chunk_count = count / (__PARALLEL_MIN_CHUNK / 4);
+
+    size_t* starts = (size_t*) malloc((chunk_count + 1) * sizeof(size_t));
+
+    if (starts == NULL) {
+      printf("Out of memory or other null pointer error while splitting utf32 buffer\n");
+      abort();
+    }
+
+    auto chunk_start = [&] (size_t i) { return count / chunk_count * i; };
+    auto chunk_end = [&] (size_t i) { return i + 1 == chunk_count? count : chunk_start(i + 1); };
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      starts[i + 1] = utf8_length(src + chunk_start(i), chunk_end(i) - chunk_start(i));
+    });
+
+    starts[0] = 0;
+    for (size_t i = 0; i < chunk_count; ++ i) starts[i + 1] += starts[i];
+
+    __parallel_run(chunk_count, thread_count, [&] (size_t i) {
+      encode_from_utf32(src + chunk_start(i), chunk_end(i) - chunk_start(i), dst + starts[i]);
+    });
+
+    size_t written = starts[chunk_count];
+
+    free(starts);
+
+    return written;
+  }
+
+
+  /* Decode the grapheme at the start of a segment for measuring, reading each malformed byte as a U+FFFD of its own like column_count */
+  static inline
+  int32_t __measure_decode (uint8_t const* bytes, size_t available, size_t& size) {
+    uint8_t c = bytes[0];
+    size = 1;
+
+    if (c < 0x80) return c;
+
+    size_t lead = __lead_size(c);
+
+    if (c < 0xC0 || c >= 0xF5 || lead > available) return 0xFFFD;
+
+    int32_t out = c & (0x7F >> lead);
+
+    for (size_t i = 1; i < lead; ++ i) {
+      if ((bytes[i] & 0xC0) != 0x80) return 0xFFFD;
+      out = (out << 6) | (bytes[i] & 0x3F);
+    }
+
+    size = lead;
+
+    return out;
+  }
+
+  extern
+  ColumnPosition column_position (StringView view, size_t columns) {
+    __WidthTable const& table = __width_table();
+    ColumnPosition position = { 0, 0, 0 };
+
+    while (position.byte_offset < view.byte_length) {
+      size_t size;
+      int32_t c = __measure_decode(view.bytes + position.byte_offset, view.byte_length - position.byte_offset, size);
+      size_t width = __char_width(table, c);
+
+      if (position.columns + width > columns) break;
+
+      position.byte_offset += size;
+      position.columns += width;
+      ++ position.char_index;
+    }
+
+    return position;
+  }
+
+  extern
+  StringView truncate_columns (StringView view, size_t columns) {
+    return view.byte_slice(0, column_position(view, columns).byte_offset);
+  }
+
+
+  /* Step over a run of whitespace a line was broken at, along with a newline ending it */
+  static
+  size_t __skip_break (uint8_t const* bytes, size_t byte_length, size_t offset) {
+    while (offset < byte_length) {
+      if (bytes[offset] == '\n') return offset + 1;
+
+      size_t size;
+      if (!is_whitespace(__measure_decode(bytes + offset, byte_length - offset, size))) break;
+
+      offset += size;
+    }
+
+    return offset;
+  }
+
+  /* Measure the line of a WrapIterator starting at its offset, finding its length and where the line after it starts.
+   * Text is only scanned again after breaking at whitespace, from there to where the line ran out, so wrapping stays linear */
+  static
+  void __wrap_line (WrapIterator& it) {
+    __WidthTable const& table = __width_table();
+    size_t offset = it.offset;
+    size_t columns = 0;
+    size_t space_start = it.offset; // Start of the run of whitespace at offset, if in one
+    size_t break_start = SIZE_MAX; // Start of the last run of whitespace after some text, where the line can end
+    size_t break_end = 0; // End of that run
+    bool in_space = false;
+
+    while (offset < it.byte_length) {
+      if (it.bytes[offset] == '\n') {
+        size_t end = offset > it.offset && it.bytes[offset - 1] == '\r'? offset - 1 : offset;
+        it.line_length = end - it.offset;
+        it.next = offset + 1;
+        return;
+      }
+
+      size_t size;
+      int32_t c = __measure_decode(it.bytes + offset, it.byte_length - offset, size);
+      size_t width = __char_width(table, c);
+      bool space = is_whitespace(c);
+
+      if (columns + width > it.width) {
+        if (space) {
+          it.line_length = (in_space? space_start : offset) - it.offset;
+          it.next = __skip_break(it.bytes, it.byte_length, offset);
+        } else if (break_start != SIZE_MAX) {
+          it.line_length = break_start - it.offset;
+          it.next = break_end;
+        } else if (offset > it.offset) {
+          it.line_length = offset - it.offset;
+          it.next = offset;
+        } else {
+          it.line_length = size;
+          it.next = offset + size;
+        }
+
+        return;
+      }
+
+      if (space) {
+        if (!in_space) {
+          space_start = offset;
+          if (offset > it.offset) break_start = offset;
+        }
+
+        if (break_start == space_start) break_end = offset + size;
+      }
+
+      in_space = space;
+      columns += width;
+      offset += size;
+    }
+
+    it.line_length = it.byte_length - it.offset;
+    it.next = it.byte_length;
+  }
+
+  WrapIterator& WrapIterator::operator ++ () {
+    offset = next;
+    if (offset < byte_length) __wrap_line(*this);
+    return *this;
+  }
+
+  WrapIterator WrappedLines::begin () const {
+    WrapIterator it { view.bytes, view.byte_length, width, 0, 0, 0 };
+    if (view.byte_length > 0) __wrap_line(it);
+    return it;
+  }
+
+  extern
+  WrappedLines wrap_columns (StringView view, size_t width) {
+    return { view, width };
+  }
+
+
+  /* Determine whether a byte may start a whitespace grapheme: an ASCII space, or the lead of one of the 2 and 3 byte sequences
+   * every other is_whitespace grapheme is encoded with (0xC2 for U+0085 and U+00A0, 0xE1 to 0xE3 for U+1680 up to U+3000) */
+  static inline
+  bool __space_lead (uint8_t c) {
+    return c == ' ' || (uint8_t) (c - '\t') < 5 || c == 0xC2 || (uint8_t) (c - 0xE1) < 3;
+  }
+
+  #ifdef UTF8_X86
+    /* Find the first byte from offset on that __space_lead accepts, a vector at a time (Stops at the last full vector otherwise) */
+    static
+    size_t __space_leads_sse2 (uint8_t const* bytes, size_t byte_length, size_t offset) {
+      __m128i const space = _mm_set1_epi8(' ');
+      __m128i const tab = _mm_set1_epi8('\t');
+      __m128i const controls = _mm_set1_epi8(4);
+      __m128i const latin = _mm_set1_epi8((char) 0xC2);
+      __m128i const first = _mm_set1_epi8((char) 0xE1);
+      __m128i const leads = _mm_set1_epi8(2);
+
+      for (; byte_length - offset >= 16; offset += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*) (bytes + offset));
+
+        // ranges are checked unsigned, by shifting them down to 0 and comparing with their min against the upper bound
+        __m128i control = _mm_sub_epi8(v, tab);
+        __m128i lead = _mm_sub_epi8(v, first);
+        __m128i hits = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(control, controls), control)),
+          _mm_or_si128(_mm_cmpeq_epi8(v, latin), _mm_cmpeq_epi8(_mm_min_epu8(lead, leads), lead))
+        );
+
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(hits);
+        if (mask != 0) return offset + __trailing_zeros(mask);
+      }
+
+      return offset;
+    }
+
+    UTF8_TARGET("avx2")
+    static
+    size_t __space_leads_avx2 (uint8_t const* bytes, size_t byte_length, size_t offset) {
+      __m256i const space = _mm256_set1_epi8(' ');
+      __m256i const tab = _mm256_set1_epi8('\t');
+      __m256i const controls = _mm256_set1_epi8(4);
+      __m256i const latin = _mm256_set1_epi8((char) 0xC2);
+      __m256i const first = _mm256_set1_epi8((char) 0xE1);
+      __m256i const leads = _mm256_set1_epi8(2);
+
+      for (; byte_length - offset >= 32; offset += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const*) (bytes + offset));
+        __m256i control = _mm256_sub_epi8(v, tab);
+        __m256i lead = _mm256_sub_epi8(v, first);
+        __m256i hits = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(_mm256_min_epu8(control, controls), control)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, latin), _mm256_cmpeq_epi8(_mm256_min_epu8(lead, leads), lead))
+        );
+
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(hits);
+        if (mask != 0) return offset + __trailing_zeros(mask);
+      }
+
+      return offset;
+    }
+  #endif
+
+  /* Get the byte size of the whitespace grapheme at an offset of a segment, 0 if there isn't one */
+  static inline
+  size_t __space_size (uint8_t const* bytes, size_t byte_length, size_t offset) {
+    uint8_t c = bytes[offset];
+
+    if (!__space_lead(c)) return 0;
+    if (c < 0x80) return 1;
+
+    size_t size;
+    int32_t decoded = __measure_decode(bytes + offset, byte_length - offset, size);
+
+    return size > 1 && is_whitespace(decoded)? size : 0;
+  }
+
+  /* Get the byte offset of the first whitespace grapheme in a segment from an offset on, byte_length if there is none */
+  static
+  size_t __next_space (uint8_t const* bytes, size_t byte_length, size_t offset) {
+    while (offset < byte_length) {
+      switch (__active_simd_level()) {
+        #ifdef UTF8_X86
+          case SimdLevel::AVX512:
+          case SimdLevel::AVX2: offset = __space_leads_avx2(bytes, byte_length, offset); break;
+          case SimdLevel::SSE2: offset = __space_leads_sse2(bytes, byte_length, offset); break;
+        #endif
+        default: break;
+      }
+
+      while (offset < byte_length && !__space_lead(bytes[offset])) ++ offset;
+
+      if (offset == byte_length || __space_size(bytes, byte_length, offset) > 0) break;
+
+      // a lead that turned out to be some other grapheme, its continuation bytes are never leads
+      ++ offset;
+    }
+
+    return offset;
+  }
+
+  /* Step over the run of whitespace at an offset of a segment, returning where it ends */
+  static inline
+  size_t __skip_spaces (uint8_t const* bytes, size_t byte_length, size_t offset) {
+    size_t size;
+    while (offset < byte_length && (size = __space_size(bytes, byte_length, offset)) > 0) offset += size;
+    return offset;
+  }
+
+  /* Step back over the run of whitespace ending a segment at end, no further than start, returning where it begins */
+  static
+  size_t __skip_spaces_back (uint8_t const* bytes, size_t start, size_t end) {
+    while (end > start) {
+      size_t lead = end - 1;
+      while (lead > start && end - lead < 3 && (bytes[lead] & 0xC0) == 0x80) -- lead;
+
+      if (__space_size(bytes, end, lead) != end - lead) break;
+
+      end = lead;
+    }
+
+    return end;
+  }
+
+  /* Find the piece of a SplitIterator after the search offset in next, or move it past the last */
+  static
+  void __split_piece (SplitIterator& it) {
+    size_t start = it.next;
+    size_t end = it.byte_length;
+
+    it.next = it.byte_length + 1;
+
+    switch (it.kind) {
+      case SplitKind::Whitespace: {
+        start = __skip_spaces(it.bytes, it.byte_length, start);
+
+        if (start < it.byte_length) {
+          end = __next_space(it.bytes, it.byte_length, start);
+          it.next = end;
+        } else {
+          start = it.byte_length + 1;
+        }
+      } break;
+
+      case SplitKind::Delimiter: {
+        if (start > it.byte_length) break;
+
+        size_t match = it.delimiter.byte_length > 0
+          ? __find(it.bytes, it.byte_length, it.delimiter.bytes, it.delimiter.byte_length, start)
+          : Match::NOT_FOUND;
+
+        if (match != Match::NOT_FOUND) {
+          end = match;
+          it.next = match + it.delimiter.byte_length;
+        }
+      } break;
+
+      case SplitKind::Lines: {
+        if (start >= it.byte_length) {
+          start = it.byte_length + 1;
+          break;
+        }
+
+        uint8_t const* newline = (uint8_t const*) memchr(it.bytes + start, '\n', it.byte_length - start);
+
+        if (newline != NULL) {
+          end = newline - it.bytes;
+          it.next = end + 1;
+          if (end > start && it.bytes[end - 1] == '\r') -- end;
+        }
+      } break;
+    }
+
+    it.offset = start;
+    it.piece_length = start <= it.byte_length? end - start : 0;
+  }
+
+  SplitIterator& SplitIterator::operator ++ () {
+    __split_piece(*this);
+    return *this;
+  }
+
+  SplitIterator SplitPieces::begin () const {
+    SplitIterator it { view.bytes, view.byte_length, delimiter, kind, 0, 0, 0 };
+    __split_piece(it);
+    return it;
+  }
+
+  extern
+  SplitPieces split_whitespace (StringView view) {
+    return { view, { }, SplitKind::Whitespace };
+  }
+
+  extern
+  SplitPieces split (StringView view, StringView delimiter) {
+    return { view, delimiter, SplitKind::Delimiter };
+  }
+
+  extern
+  SplitPieces lines (StringView view) {
+    return { view, { }, SplitKind::Lines };
+  }
+
+  extern
+  StringView trim (StringView view) {
+    size_t start = __skip_spaces(view.bytes, view.byte_length, 0);
+    size_t end = __skip_spaces_back(view.bytes, start, view.byte_length);
+    return { view.bytes + start, end - start };
+  }
+
+  void String::trim () {
+    size_t start = __skip_spaces(bytes, byte_length, 0);
+    size_t end = __skip_spaces_back(bytes, start, byte_length);
+
+    if (start == 0 && end == byte_length) return;
+
+    unshare();
+
+    __shift_bytes(bytes, bytes + start, end - start);
+    byte_length = end - start;
+    bytes[byte_length] = 0;
+
+    // a malformed sequence next to the whitespace counts differently once it is gone, so the length is counted again on demand
+    clear_caches();
+  }
+
+  void String::collapse_whitespace () {
+    if (byte_length == 0) return;
+
+    unshare();
+
+    size_t read = __skip_spaces(bytes, byte_length, 0);
+    size_t write = 0;
+
+    // every run of whitespace shrinks to at most a byte, so what is written never catches up with what is read
+    while (read < byte_length) {
+      size_t space = __next_space(bytes, byte_length, read);
+
+      if (write != read) __shift_bytes(bytes + write, bytes + read, space - read);
+      write += space - read;
+
+      read = __skip_spaces(bytes, byte_length, space);
+      if (read < byte_length) bytes[write ++] = ' ';
+    }
+
+    if (write == byte_length) return;
+
+    byte_length = write;
+    bytes[byte_length] = 0;
+
+    clear_caches();
+  }
+
+
+  /* Start utf8proc's grapheme break state at a grapheme beginning a cluster (The state only takes a grapheme in as the second
+   * of a pair, so emoji and regional indicators that start a cluster need a pair with a newline, which always breaks before them) */
+  static inline
+  int32_t __cluster_state (int32_t first) {
+    int32_t state = 0;
+    if (first >= 0x80) utf8proc_grapheme_break_stateful('\n', first, &state);
+    return state;
+  }
+
+  /* Determine whether there is an extended grapheme cluster boundary between two graphemes, carrying utf8proc's state along.
+   * Nothing attaches ASCII to what comes before it unless that is a prepending character, none of which are below U+0300,
+   * so only CR LF stays together there, and ASCII leaves no state behind */
+  static inline
+  bool __cluster_break (int32_t previous, int32_t c, int32_t& state) {
+    if (previous < 0x300 && c < 0x80) {
+      state = 0;
+      return previous != '\r' || c != '\n';
+    }
+
+    return utf8proc_grapheme_break_stateful(previous, c, &state);
+  }
+
+  /* Step a byte offset at a cluster boundary forward by up to count extended grapheme clusters, returning how many it moved */
+  static
+  size_t __cluster_advance (uint8_t const* bytes, size_t byte_length, size_t& offset, size_t count) {
+    if (offset >= byte_length || count == 0) return 0;
+
+    size_t size;
+    int32_t previous = __measure_decode(bytes + offset, byte_length - offset, size);
+    int32_t state = __cluster_state(previous);
+    size_t stepped = 0;
+
+    offset += size;
+
+    while (offset < byte_length) {
+      int32_t c = __measure_decode(bytes + offset, byte_length - offset, size);
+
+      if (__cluster_break(previous, c, state) && ++ stepped == count) return stepped;
+
+      previous = c;
+      offset += size;
+    }
+
+    return stepped + 1;
+  }
+
+  /* Build a ClusterIndex for a StringView until it has more than entry entries and one past a byte offset, or reaches the end */
+  static
+  void __cluster_index_extend (StringView view, ClusterIndex& ix, size_t entry, size_t byte_offset) {
+    if (ix.count == 0) {
+      if (ix.capacity == 0) {
+        ix.capacity = 16;
+        ix.offsets = (size_t*) malloc(ix.capacity * sizeof(size_t));
+
+        if (ix.offsets == NULL) {
+          printf("Out of memory or other null pointer error while building cluster index\n");
+          abort();
+        }
+      }
+
+      ix.offsets[ix.count ++] = 0;
+    }
+
+    while (!ix.complete && (ix.count <= entry || ix.offsets[ix.count - 1] <= byte_offset)) {
+      size_t offset = ix.offsets[ix.count - 1];
+
+      if (__cluster_advance(view.bytes, view.byte_length, offset, ClusterIndex::STRIDE) < ClusterIndex::STRIDE || offset >= view.byte_length) {
+        ix.complete = true;
+        break;
+      }
+
+      if (ix.count == ix.capacity) {
+        ix.capacity *= 2;
+        ix.offsets = (size_t*) realloc(ix.offsets, ix.capacity * sizeof(size_t));
+
+        if (ix.offsets == NULL) {
+          printf("Out of memory or other null pointer error while building cluster index\n");
+          abort();
+        }
+      }
+
+      ix.offsets[ix.count ++] = offset;
+    }
+  }
+
+  void ClusterIndex::truncate (size_t byte_offset) {
+    while (count > 1 && offsets[count - 1] >= byte_offset) -- count;
+    complete = false;
+  }
+
+  void ClusterIndex::dispose () {
+    if (offsets != NULL) free(offsets);
+    offsets = NULL;
+    count = 0;
+    capacity = 0;
+    complete = false;
+  }
+
+
+  ClusterIterator& ClusterIterator::operator ++ () {
+    offset += cluster_length;
+    size_t end = offset;
+    __cluster_advance(bytes, byte_length, end, 1);
+    cluster_length = end - offset;
+    return *this;
+  }
+
+  ClusterIterator Clusters::begin () const {
+    ClusterIterator it { view.bytes, view.byte_length, 0, 0 };
+    __cluster_advance(view.bytes, view.byte_length, it.cluster_length, 1);
+    return it;
+  }
+
+  extern
+  Clusters clusters (StringView view) {
+    return { view };
+  }
+
+  extern
+  size_t cluster_count (StringView view) {
+    size_t offset = 0;
+    return __cluster_advance(view.bytes, view.byte_length, offset, SIZE_MAX);
+  }
+
+  extern
+  size_t cluster_size (StringView view, size_t byte_offset) {
+    size_t end = byte_offset;
+    __cluster_advance(view.bytes, view.byte_length, end, 1);
+    return end > byte_offset? end - byte_offset : 0;
+  }
+
+  extern
+  size_t cluster_offset (StringView view, size_t index, ClusterIndex* cache) {
+    size_t offset = 0;
+    size_t remaining = index;
+
+    if (cache != NULL) {
+      size_t entry = index / ClusterIndex::STRIDE;
+      __cluster_index_extend(view, *cache, entry, 0);
+
+      if (entry >= cache->count) entry = cache->count - 1;
+
+      offset = cache->offsets[entry];
+      remaining = index - entry * ClusterIndex::STRIDE;
+    }
+
+    if (__cluster_advance(view.bytes, view.byte_length, offset, remaining) < remaining) return view.byte_length;
+
+    return offset < view.byte_length? offset : view.byte_length;
+  }
+
+  extern
+  size_t cluster_start (StringView view, size_t byte_offset, ClusterIndex* cache) {
+    if (byte_offset >= view.byte_length) return view.byte_length;
+
+    size_t start = 0;
+
+    if (cache != NULL) {
+      __cluster_index_extend(view, *cache, 0, byte_offset);
+
+      // the last entry at or before the offset, the one after it (if any) is past it
+      size_t low = 0;
+      size_t high = cache->count;
+
+      while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (cache->offsets[middle] <= byte_offset) low = middle;
+        else high = middle;
+      }
+
+      start = cache->offsets[low];
+    }
+
+    while (true) {
+      size_t end = start;
+      __cluster_advance(view.bytes, view.byte_length, end, 1);
+
+      if (end > byte_offset) return start;
+
+      start = end;
+    }
+  }
+
+
+  // utf8proc_option_t flags that decompose a single grapheme the way utf8proc_NFKC_Casefold does before composing
+  static constexpr int __FOLD_OPTIONS = (1 << 2) | (1 << 4) | (1 << 5) | (1 << 10); // COMPAT | DECOMPOSE | IGNORE | CASEFOLD
+
+  // Longest decomposition utf8proc gives a single grapheme with __FOLD_OPTIONS is 18, for U+FDFA
+  static constexpr size_t __FOLD_DECOMPOSITION_MAX = 32;
+
+  // Most runs are a starter and a few marks, longer ones move to the heap
+  static constexpr size_t __FOLD_RUN_INLINE = 32;
+
+  /* Produces the NFKC casefolded graphemes of a segment one at a time, fully decomposed and in canonical order.
+   * Two segments casefold to the same String exactly when these streams match, as composition only depends on them */
+  struct __FoldStream {
+    uint8_t const* bytes;
+    size_t byte_length;
+    size_t offset;
+    int32_t* run; // A starter and the non-starters following it
+    size_t run_capacity;
+    size_t run_length;
+    size_t run_index;
+    size_t carry_length; // Length of the decomposition that starts the next run
+    int32_t carry [__FOLD_DECOMPOSITION_MAX];
+    int32_t inline_run [__FOLD_RUN_INLINE];
+  };
+
+  static inline
+  void __fold_init (__FoldStream& s, StringView view) {
+    s.bytes = view.bytes;
+    s.byte_length = view.byte_length;
+    s.offset = 0;
+    s.run = s.inline_run;
+    s.run_capacity = __FOLD_RUN_INLINE;
+    s.run_length = 0;
+    s.run_index = 0;
+    s.carry_length = 0;
+  }
+
+  static inline
+  void __fold_dispose (__FoldStream& s) {
+    if (s.run != s.inline_run) free(s.run);
+  }
+
+  static inline
+  int32_t __ascii_fold (uint8_t c) {
+    return (uint8_t) (c - 'A') < 26? c + 32 : c;
+  }
+
+  static inline
+  int16_t __combining_class (int32_t c) {
+    return c < 0x300? 0 : utf8proc_get_property(c)->combining_class;
+  }
+
+  static
+  void __fold_append (__FoldStream& s, int32_t const* graphemes, size_t count) {
+    if (s.run_length + count > s.run_capacity) {
+      size_t new_capacity = s.run_capacity * 2;
+      while (new_capacity < s.run_length + count) new_capacity *= 2;
+
+      int32_t* new_run = (int32_t*) malloc(new_capacity * sizeof(int32_t));
+
+      if (new_run == NULL) {
+        printf("Out of memory or other null pointer error while casefolding utf8 string\n");
+        abort();
+      }
+
+      memcpy(new_run, s.run, s.run_length * sizeof(int32_t));
+      if (s.run != s.inline_run) free(s.run);
+
+      s.run = new_run;
+      s.run_capacity = new_capacity;
+    }
+
+    memcpy(s.run + s.run_length, graphemes, count * sizeof(int32_t));
+    s.run_length += count;
+  }
+
+  /* Decompose the next run of a FoldStream, up to the grapheme whose decomposition starts with a starter */
+  static
+  bool __fold_fill (__FoldStream& s) {
+    s.run_length = 0;
+    s.run_index = 0;
+
+    if (s.carry_length > 0) {
+      __fold_append(s, s.carry, s.carry_length);
+      s.carry_length = 0;
+    }
+
+    while (s.offset < s.byte_length) {
+      uint8_t c = s.bytes[s.offset];
+      int32_t decomposition [__FOLD_DECOMPOSITION_MAX];
+      size_t count = 1;
+
+      if (c < 0x80) {
+        decomposition[0] = __ascii_fold(c);
+        ++ s.offset;
+      } else {
+        int32_t original = __to_int_bounded(s.bytes + s.offset, s.byte_length - s.offset);
+        s.offset += __lead_size(c);
+
+        ptrdiff_t result = utf8proc_decompose_char(original, decomposition, __FOLD_DECOMPOSITION_MAX, __FOLD_OPTIONS, NULL);
+
+        // code points utf8proc rejects, such as surrogates, are passed through as they are
+        if (result < 0) decomposition[0] = original;
+        else count = (size_t) result < __FOLD_DECOMPOSITION_MAX? (size_t) result : __FOLD_DECOMPOSITION_MAX;
+      }
+
+      if (count == 0) continue;
+
+      if (s.run_length > 0 && __combining_class(decomposition[0]) == 0) {
+        memcpy(s.carry, decomposition, count * sizeof(int32_t));
+        s.carry_length = count;
+        break;
+      }
+
+      __fold_append(s, decomposition, count);
+    }
+
+    // canonical ordering is a stable sort by combining class of each stretch of non-starters
+    for (size_t i = 1; i < s.run_length; ++ i) {
+      int32_t c = s.run[i];
+      int16_t combining_class = __combining_class(c);
+
+      if (combining_class == 0) continue;
+
+      size_t j = i;
+
+      while (j > 0 && __combining_class(s.run[j - 1]) > combining_class) {
+        s.run[j] = s.run[j - 1];
+        -- j;
+      }
+
+      s.run[j] = c;
+    }
+
+    return s.run_length > 0;
+  }
+
+  /* Determine whether the next grapheme of a FoldStream comes straight from an ASCII byte, with nothing decomposed pending */
+  static inline
+  bool __fold_at_ascii (__FoldStream const& s) {
+    return s.run_index == s.run_length && s.carry_length == 0 && s.offset < s.byte_length && s.bytes[s.offset] < 0x80;
+  }
+
+  static inline
+  bool __fold_next (__FoldStream& s, int32_t& c) {
+    if (s.run_index < s.run_length) {
+      c = s.run[s.run_index ++];
+      return true;
+    }
+
+    if (__fold_at_ascii(s)) {
+      c = __ascii_fold(s.bytes[s.offset ++]);
+      return true;
+    }
+
+    if (!__fold_fill(s)) return false;
+
+    c = s.run[s.run_index ++];
+    return true;
+  }
+
+  extern
+  int casefold_compare (StringView a, StringView b) {
+    __FoldStream sa;
+    __FoldStream sb;
+    __fold_init(sa, a);
+    __fold_init(sb, b);
+
+    int result = 0;
+
+    while (true) {
+      // ASCII compares bytewise without going through utf8proc, and a grapheme after it can't change how it folds
+      while (__fold_at_ascii(sa) && __fold_at_ascii(sb)) {
+        int32_t ca = __ascii_fold(sa.bytes[sa.offset]);
+        int32_t cb = __ascii_fold(sb.bytes[sb.offset]);
+
+        if (ca != cb) {
+          result = ca < cb? -1 : 1;
+          break;
+        }
+
+        ++ sa.offset;
+        ++ sb.offset;
+      }
+
+      if (result != 0) break;
+
+      int32_t ca;
+      int32_t cb;
+      bool has_a = __fold_next(sa, ca);
+      bool has_b = __fold_next(sb, cb);
+
+      if (!has_a || !has_b) {
+        result = (int) has_a - (int) has_b;
+        break;
+      }
+
+      if (ca != cb) {
+        result = ca < cb? -1 : 1;
+        break;
+      }
+    }
+
+    __fold_dispose(sa);
+    __fold_dispose(sb);
+
+    return result;
+  }
+
+  extern
+  bool casefold_equal (StringView a, StringView b) {
+    return casefold_compare(a, b) == 0;
+  }
+
+  extern
+  uint64_t casefold_hash (StringView view) {
+    __FoldStream s;
+    __fold_init(s, view);
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (true) {
+      while (__fold_at_ascii(s)) {
+        hash = (hash ^ (uint64_t) __ascii_fold(s.bytes[s.offset ++])) * 1099511628211ULL;
+      }
+
+      int32_t c;
+      if (!__fold_next(s, c)) break;
+
+      uint8_t encoded [4];
+      size_t size = utf8::encode(c, encoded);
+
+      for (size_t i = 0; i < size; ++ i) hash = (hash ^ (uint64_t) encoded[i]) * 1099511628211ULL;
+    }
+
+    __fold_dispose(s);
+
+    return hash;
+  }
+
+
+  // utf8proc_option_t flags for each NormalForm, in order: STABLE with COMPOSE or DECOMPOSE, and COMPAT for the NFK forms
+  static constexpr int __NORMAL_OPTIONS [4] = { (1 << 1) | (1 << 3), (1 << 1) | (1 << 4), (1 << 1) | (1 << 2) | (1 << 3), (1 << 1) | (1 << 2) | (1 << 4) };
+
+  // Spans of at most this many graphemes once decomposed are normalized without allocating
+  static constexpr size_t __NORMAL_SPAN_INLINE = 64;
+
+  /* Table of which graphemes pass the normalization quick check of each NormalForm, a bit per form packed two graphemes to a byte.
+   * A grapheme passes when it is a starter the form leaves as it is, and for the composed forms also never the second half of a
+   * composition, so nothing next to it changes it or is changed across it. Laid out like the __WidthTable */
+  struct __NormalTable {
+    uint8_t bmp [0x10000 >> 1];
+    uint16_t blocks [(0x110000 - 0x10000) >> 8];
+    uint8_t const* flags;
+  };
+
+  // Marks a grapheme found after the first position of a canonical decomposition while building a __NormalTable
+  static constexpr uint8_t __NORMAL_SECOND = 0x10;
+
+  static inline
+  uint8_t __normal_bit (NormalForm form) {
+    return (uint8_t) (1 << (int) form);
+  }
+
+  /* Determine whether a decomposition composes back to the single grapheme it came from */
+  static
+  bool __normal_recomposes (int32_t const* decomposition, ptrdiff_t count, int32_t c) {
+    int32_t buffer [__FOLD_DECOMPOSITION_MAX];
+    memcpy(buffer, decomposition, count * sizeof(int32_t));
+    return utf8proc_normalize_utf32(buffer, count, __NORMAL_OPTIONS[(int) NormalForm::NFC]) == 1 && buffer[0] == c;
+  }
+
+  static
+  __NormalTable __build_normal_table () {
+    __NormalTable table;
+    __BlockSet set = { NULL, 0, 0 };
+    uint8_t block [128];
+    uint8_t* flags = (uint8_t*) calloc(0x110000, 1);
+
+    if (flags == NULL) {
+      printf("Out of memory or other null pointer error while building lookup table\n");
+      abort();
+    }
+
+    uint8_t composed = __normal_bit(NormalForm::NFC) | __normal_bit(NormalForm::NFKC);
+
+    for (int32_t c = 0; c < 0x110000; ++ c) {
+      // surrogates are malformed in utf8 and never looked up, ASCII is left alone by every form
+      if (c < 0x80 || (c >= 0xD800 && c < 0xE000)) {
+        flags[c] |= 0x0F;
+        continue;
+      }
+
+      int32_t canonical [__FOLD_DECOMPOSITION_MAX];
+      int32_t compatible [__FOLD_DECOMPOSITION_MAX];
+      ptrdiff_t canonical_count = utf8proc_decompose_char(c, canonical, __FOLD_DECOMPOSITION_MAX, __NORMAL_OPTIONS[(int) NormalForm::NFD], NULL);
+      ptrdiff_t compatible_count = utf8proc_decompose_char(c, compatible, __FOLD_DECOMPOSITION_MAX, __NORMAL_OPTIONS[(int) NormalForm::NFKD], NULL);
+
+      for (ptrdiff_t i = 1; i < canonical_count; ++ i) flags[canonical[i]] |= __NORMAL_SECOND;
+
+      if (__combining_class(c) != 0) continue;
+
+      if (canonical_count == 1 && canonical[0] == c) flags[c] |= __normal_bit(NormalForm::NFD) | __normal_bit(NormalForm::NFC);
+      else if (canonical_count > 0 && __normal_recomposes(canonical, canonical_count, c)) flags[c] |= __normal_bit(NormalForm::NFC);
+
+      if (compatible_count == 1 && compatible[0] == c) flags[c] |= __normal_bit(NormalForm::NFKD) | __normal_bit(NormalForm::NFKC);
+      else if (compatible_count > 0 && __normal_recomposes(compatible, compatible_count, c)) flags[c] |= __normal_bit(NormalForm::NFKC);
+    }
+
+    for (int32_t c = 0; c < 0x110000; ++ c) {
+      if (flags[c] & __NORMAL_SECOND) flags[c] &= ~composed;
+      flags[c] &= 0x0F;
+    }
+
+    for (int32_t c = 0; c < 0x10000; c += 2) table.bmp[c >> 1] = flags[c] | (flags[c + 1] << 4);
+
+    for (int32_t high = 0x100; high < (0x110000 >> 8); ++ high) {
+      for (int32_t low = 0; low < 256; low += 2) block[low >> 1] = flags[(high << 8) | low] | (flags[(high << 8) | (low + 1)] << 4);
+
+      table.blocks[high - 0x100] = __intern_block(set, block, sizeof(block));
+    }
+
+    free(flags);
+
+    table.flags = set.data;
+
+    return table;
+  }
+
+  static
+  __NormalTable const& __normal_table () {
+    static __NormalTable const table = __build_normal_table();
+    return table;
+  }
+
+  static inline
+  bool __normal_passes (__NormalTable const& table, int32_t c, uint8_t bit) {
+    uint8_t const* packed = c < 0x10000? table.bmp : table.flags + (size_t) table.blocks[(c >> 8) - 0x100] * 128;
+    return (packed[(c & (c < 0x10000? 0xFFFF : 0xFF)) >> 1] >> ((c & 1) * 4)) & bit;
+  }
+
+  /* Decode the grapheme at the start of a segment for normalizing, -1 for a malformed byte, which is left as it is (Of size 1) */
+  static inline
+  int32_t __normal_decode (uint8_t const* bytes, size_t available, size_t& size) {
+    static constexpr int32_t minimum [5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+    int32_t c = __measure_decode(bytes, available, size);
+
+    if (size == 1) return bytes[0] < 0x80? c : -1;
+
+    if (c < minimum[size] || (c >= 0xD800 && c < 0xE000) || c >= 0x110000) {
+      size = 1;
+      return -1;
+    }
+
+    return c;
+  }
+
+  /* Find the next span from an offset of a segment that the quick check can't pass. It starts at the last passing grapheme before
+   * the first one that doesn't, which may compose with it, and ends at the next passing grapheme or malformed byte. False if there is none */
+  static
+  bool __normal_next_span (__NormalTable const& table, uint8_t bit, uint8_t const* bytes, size_t byte_length, size_t offset, size_t& start, size_t& end) {
+    size_t boundary = offset;
+
+    while (offset < byte_length) {
+      uint8_t c = bytes[offset];
+
+      if (c < 0x80) {
+        // short runs between accented letters are skipped here, the vector kernels only pay off on long ones
+        size_t run_end = byte_length - offset > 16? offset + 16 : byte_length;
+
+        do ++ offset;
+        while (offset < run_end && (c = bytes[offset]) != '\0' && c < 0x80);
+
+        if (offset == run_end && offset < byte_length) {
+          size_t printable = 0;
+          offset += __ascii_run(bytes + offset, byte_length - offset, printable);
+        }
+
+        boundary = offset - 1;
+        continue;
+      }
+
+      size_t size;
+      int32_t decoded = __normal_decode(bytes + offset, byte_length - offset, size);
+
+      if (decoded < 0) {
+        offset += size;
+        boundary = offset;
+        continue;
+      }
+
+      if (__normal_passes(table, decoded, bit)) {
+        boundary = offset;
+        offset += size;
+        continue;
+      }
+
+      start = boundary;
+      offset += size;
+
+      while (offset < byte_length && bytes[offset] >= 0x80) {
+        decoded = __normal_decode(bytes + offset, byte_length - offset, size);
+        if (decoded < 0 || __normal_passes(table, decoded, bit)) break;
+        offset += size;
+      }
+
+      end = offset;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  /* Scratch space for the graphemes of a span being normalized */
+  struct __NormalBuffer {
+    int32_t* graphemes;
+    size_t capacity;
+    int32_t inline_graphemes [__NORMAL_SPAN_INLINE];
+  };
+
+  static inline
+  void __normal_buffer_init (__NormalBuffer& b) {
+    b.graphemes = b.inline_graphemes;
+    b.capacity = __NORMAL_SPAN_INLINE;
+  }
+
+  static inline
+  void __normal_buffer_dispose (__NormalBuffer& b) {
+    if (b.graphemes != b.inline_graphemes) free(b.graphemes);
+  }
+
+  /* Normalize a span of well formed utf8 into a __NormalBuffer, returning the number of graphemes in the result */
+  static
+  size_t __normal_span (__NormalBuffer& b, uint8_t const* span, size_t length, NormalForm form) {
+    int options = __NORMAL_OPTIONS[(int) form];
+    ptrdiff_t count = utf8proc_decompose(span, (ptrdiff_t) length, b.graphemes, (ptrdiff_t) b.capacity, options);
+
+    if (count > (ptrdiff_t) b.capacity) {
+      if (b.graphemes != b.inline_graphemes) free(b.graphemes);
+
+      b.capacity = (size_t) count;
+      b.graphemes = (int32_t*) malloc(b.capacity * sizeof(int32_t));
+
+      if (b.graphemes == NULL) {
+        printf("Out of memory or other null pointer error while normalizing utf8 string\n");
+        abort();
+      }
+
+      count = utf8proc_decompose(span, (ptrdiff_t) length, b.graphemes, (ptrdiff_t) b.capacity, options);
+    }
+
+    if (count > 0) count = utf8proc_normalize_utf32(b.graphemes, count, options);
+
+    // spans only hold well formed graphemes, which utf8proc always accepts
+    if (count < 0) {
+      printf("utf8proc rejected a span of well formed utf8 while normalizing\n");
+      abort();
+    }
+
+    return (size_t) count;
+  }
+
+  /* Determine whether graphemes encode to exactly the bytes of a span */
+  static
+  bool __normal_span_equal (int32_t const* graphemes, size_t count, uint8_t const* span, size_t length) {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < count; ++ i) {
+      uint8_t encoded [4];
+      size_t size = utf8::encode(graphemes[i], encoded);
+
+      if (size > length - offset || memcmp(encoded, span + offset, size) != 0) return false;
+
+      offset += size;
+    }
+
+    return offset == length;
+  }
+
+  extern
+  bool is_normalized (StringView view, NormalForm form) {
+    __NormalTable const& table = __normal_table();
+    uint8_t bit = __normal_bit(form);
+    __NormalBuffer b;
+    __normal_buffer_init(b);
+
+    bool result = true;
+    size_t offset = 0;
+    size_t start;
+    size_t end;
+
+    while (result && __normal_next_span(table, bit, view.bytes, view.byte_length, offset, start, end)) {
+      size_t count = __normal_span(b, view.bytes + start, end - start, form);
+      result = __normal_span_equal(b.graphemes, count, view.bytes + start, end - start);
+      offset = end;
+    }
+
+    __normal_buffer_dispose(b);
+
+    return result;
+  }
+
+  extern
+  StringView normalize (StringView view, NormalForm form, String& storage) {
+    __NormalTable const& table = __normal_table();
+    uint8_t bit = __normal_bit(form);
+    __NormalBuffer b;
+    __normal_buffer_init(b);
+
+    bool writing = false;
+    size_t copied = 0; // Bytes of view before this are in storage, once writing
+    size_t offset = 0;
+    size_t start;
+    size_t end;
+
+    while (__normal_next_span(table, bit, view.bytes, view.byte_length, offset, start, end)) {
+      size_t count = __normal_span(b, view.bytes + start, end - start, form);
+      offset = end;
+
+      // the view is returned as it is until a span turns out to change
+      if (__normal_span_equal(b.graphemes, count, view.bytes + start, end - start)) continue;
+
+      if (!writing) {
+        if (storage.shared != NULL) storage.dispose();
+
+        storage.byte_length = 0;
+        storage.char_length = 0;
+        storage.clear_char_index();
+        storage.grow_allocation(view.byte_length);
+
+        writing = true;
+      }
+
+      if (start > copied) storage.insert(view.bytes + copied, start - copied);
+
+      for (size_t i = 0; i < count; ++ i) storage.insert(b.graphemes[i]);
+
+      copied = end;
+    }
+
+    __normal_buffer_dispose(b);
+
+    if (!writing) return view;
+
+    if (view.byte_length > copied) storage.insert(view.bytes + copied, view.byte_length - copied);
+
+    return StringView { storage };
+  }
+
+
+  struct RopeNode {
+    RopeNode* left;
+    RopeNode* right;
+    uint32_t priority;
+    uint32_t length; // Bytes used in this node's chunk
+    size_t chars; // Graphemes in this node's chunk
+    size_t newlines; // '\n' bytes in this node's chunk
+    size_t total_bytes; // Totals of the subtree rooted at this node, including its own chunk
+    size_t total_chars;
+    size_t total_newlines;
+    uint8_t bytes [Rope::CHUNK_CAPACITY];
+  };
+
+  static inline
+  size_t __count_newlines (uint8_t const* bytes, size_t length) {
+    size_t count = 0;
+    uint8_t const* end = bytes + length;
+
+    while ((bytes = (uint8_t const*) memchr(bytes, '\n', end - bytes)) != NULL) {
+      ++ count;
+      ++ bytes;
+    }
+
+    return count;
+  }
+
+  /* Byte offset of a grapheme index inside a chunk */
+  static inline
+  size_t __chunk_offset (uint8_t const* bytes, size_t length, size_t index) {
+    size_t offset = 0;
+    __view_advance(bytes, length, offset, index);
+    return offset;
+  }
+
+  static inline
+  size_t __rope_bytes (RopeNode const* node) { return node != NULL? node->total_bytes : 0; }
+
+  static inline
+  size_t __rope_chars (RopeNode const* node) { return node != NULL? node->total_chars : 0; }
+
+  static inline
+  size_t __rope_newlines (RopeNode const* node) { return node != NULL? node->total_newlines : 0; }
+
+  /* Recount the graphemes and newlines of a node's own chunk */
+  static inline
+  void __rope_recount (RopeNode* node) {
+    node->chars = __char_count(node->bytes, node->length, false);
+    node->newlines = __count_newlines(node->bytes, node->length);
+  }
+
+  /* Recompute the subtree totals of a node from its chunk and children */
+  static inline
+  void __rope_update (RopeNode* node) {
+    node->total_bytes = node->length + __rope_bytes(node->left) + __rope_bytes(node->right);
+    node->total_chars = node->chars + __rope_chars(node->left) + __rope_chars(node->right);
+    node->total_newlines = node->newlines + __rope_newlines(node->left) + __rope_newlines(node->right);
+  }
+
+  /* Create a childless node holding a chunk, with a fresh priority drawn from a Rope's seed */
+  static
+  RopeNode* __rope_node (uint32_t& seed, uint8_t const* bytes, size_t length) {
+    RopeNode* node = (RopeNode*) malloc(sizeof(RopeNode));
+
+    if (node == NULL) {
+      printf("Out of memory or other null pointer error while growing Rope\n");
+      abort();
+    }
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    node->left = NULL;
+    node->right = NULL;
+    node->priority = seed;
+    node->length = (uint32_t) length;
+    memcpy(node->bytes, bytes, length);
+
+    __rope_recount(node);
+    __rope_update(node);
+
+    return node;
+  }
+
+  static
+  void __rope_free (RopeNode* node) {
+    while (node != NULL) {
+      __rope_free(node->left);
+      RopeNode* right = node->right;
+      free(node);
+      node = right;
+    }
+  }
+
+  /* Join two trees, every grapheme of a coming before every grapheme of b */
+  static
+  RopeNode* __rope_merge (RopeNode* a, RopeNode* b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    if (a->priority > b->priority) {
+      a->right = __rope_merge(a->right, b);
+      __rope_update(a);
+      return a;
+    } else {
+      b->left = __rope_merge(a, b->left);
+      __rope_update(b);
+      return b;
+    }
+  }
+
+  /* Split a tree into the graphemes before an index and those from it on, cutting a chunk in two if the index lands inside it */
+  static
+  void __rope_split (RopeNode* node, size_t index, RopeNode*& left, RopeNode*& right, uint32_t& seed) {
+    if (node == NULL) {
+      left = right = NULL;
+      return;
+    }
+
+    size_t left_chars = __rope_chars(node->left);
+
+    if (index <= left_chars) {
+      __rope_split(node->left, index, left, node->left, seed);
+      __rope_update(node);
+      right = node;
+    } else if (index >= left_chars + node->chars) {
+      __rope_split(node->right, index - left_chars - node->chars, node->right, right, seed);
+      __rope_update(node);
+      left = node;
+    } else {
+      size_t offset = __chunk_offset(node->bytes, node->length, index - left_chars);
+
+      // the second half inherits the priority, which already outranks the right subtree it takes over
+      RopeNode* tail = __rope_node(seed, node->bytes + offset, node->length - offset);
+      tail->priority = node->priority;
+      tail->right = node->right;
+      __rope_update(tail);
+
+      node->length = (uint32_t) offset;
+      node->right = NULL;
+      __rope_recount(node);
+      __rope_update(node);
+
+      left = node;
+      right = tail;
+    }
+  }
+
+  /* Cut a segment into chunks, each ending on a sequence boundary, and merge them into one tree */
+  static
+  RopeNode* __rope_build (uint8_t const* bytes, size_t length, uint32_t& seed) {
+    RopeNode* out = NULL;
+    size_t offset = 0;
+
+    while (offset < length) {
+      size_t end = offset + Rope::CHUNK_CAPACITY;
+
+      if (end >= length) end = length;
+      else while (end > offset && (bytes[end] & 0xC0) == 0x80) -- end;
+
+      // a run of continuation bytes longer than a chunk has no boundary to back up to
+      if (end == offset) end = offset + Rope::CHUNK_CAPACITY;
+
+      out = __rope_merge(out, __rope_node(seed, bytes + offset, end - offset));
+      offset = end;
+    }
+
+    return out;
+  }
+
+  /* Find the node holding a grapheme index, and the index inside its chunk */
+  static
+  RopeNode* __rope_locate (RopeNode* node, size_t& index) {
+    while (node != NULL) {
+      size_t left_chars = __rope_chars(node->left);
+
+      if (index < left_chars) {
+        node = node->left;
+        continue;
+      }
+
+      index -= left_chars;
+
+      if (index < node->chars) return node;
+
+      index -= node->chars;
+      node = node->right;
+    }
+
+    return NULL;
+  }
+
+  /* Insert into the chunk an index lands in if there is room, adding to the totals on the way back up (False leaves the tree untouched) */
+  static
+  bool __rope_insert_in_place (RopeNode* node, size_t index, StringView src, size_t chars, size_t newlines) {
+    if (node == NULL) return false;
+
+    size_t left_chars = __rope_chars(node->left);
+    bool fits = node->length + src.byte_length <= Rope::CHUNK_CAPACITY;
+    bool inserted;
+
+    // an index on the edge of a full chunk can still go at the end of the previous one or the start of the next
+    if (index < left_chars || (index == left_chars && !fits && node->left != NULL)) {
+      inserted = __rope_insert_in_place(node->left, index, src, chars, newlines);
+    } else if (index > left_chars + node->chars || (index == left_chars + node->chars && !fits && node->right != NULL)) {
+      inserted = __rope_insert_in_place(node->right, index - left_chars - node->chars, src, chars, newlines);
+    } else if (fits) {
+      size_t offset = __chunk_offset(node->bytes, node->length, index - left_chars);
+
+      memmove(node->bytes + offset + src.byte_length, node->bytes + offset, node->length - offset);
+      memcpy(node->bytes + offset, src.bytes, src.byte_length);
+
+      node->length += (uint32_t) src.byte_length;
+      node->chars += chars;
+      node->newlines += newlines;
+      inserted = true;
+    } else {
+      inserted = false;
+    }
+
+    if (inserted) {
+      node->total_bytes += src.byte_length;
+      node->total_chars += chars;
+      node->total_newlines += newlines;
+    }
+
+    return inserted;
+  }
+
+  /* Remove a range from the chunk it starts in if it ends there too and leaves the chunk non-empty, subtracting from the totals on the way back up */
+  static
+  bool __rope_remove_in_place (RopeNode* node, size_t index, size_t count, size_t& bytes, size_t& newlines) {
+    if (node == NULL) return false;
+
+    size_t left_chars = __rope_chars(node->left);
+    bool removed;
+
+    if (index < left_chars) {
+      removed = __rope_remove_in_place(node->left, index, count, bytes, newlines);
+    } else if (index >= left_chars + node->chars) {
+      removed = __rope_remove_in_place(node->right, index - left_chars - node->chars, count, bytes, newlines);
+    } else if (index - left_chars + count <= node->chars && count < node->chars) {
+      size_t base = __chunk_offset(node->bytes, node->length, index - left_chars);
+      size_t end = base;
+      __view_advance(node->bytes, node->length, end, count);
+
+      bytes = end - base;
+      newlines = __count_newlines(node->bytes + base, bytes);
+
+      memmove(node->bytes + base, node->bytes + end, node->length - end);
+
+      node->length -= (uint32_t) bytes;
+      node->chars -= count;
+      node->newlines -= newlines;
+      removed = true;
+    } else {
+      removed = false;
+    }
+
+    if (removed) {
+      node->total_bytes -= bytes;
+      node->total_chars -= count;
+      node->total_newlines -= newlines;
+    }
+
+    return removed;
+  }
+
+  /* Detach the first node of a tree, which is returned through first */
+  static
+  RopeNode* __rope_pop_first (RopeNode* node, RopeNode*& first) {
+    if (node->left == NULL) {
+      first = node;
+      RopeNode* right = node->right;
+      node->right = NULL;
+      __rope_update(node);
+      return right;
+    }
+
+    node->left = __rope_pop_first(node->left, first);
+    __rope_update(node);
+
+    return node;
+  }
+
+  /* Append a chunk to the last node of a tree, which must have room for it */
+  static
+  void __rope_append_last (RopeNode* node, uint8_t const* bytes, size_t length) {
+    if (node->right != NULL) {
+      __rope_append_last(node->right, bytes, length);
+    } else {
+      memcpy(node->bytes + node->length, bytes, length);
+      node->length += (uint32_t) length;
+      __rope_recount(node);
+    }
+
+    __rope_update(node);
+  }
+
+  static
+  RopeNode const* __rope_last (RopeNode const* node) {
+    while (node != NULL && node->right != NULL) node = node->right;
+    return node;
+  }
+
+  /* Merge two trees, first folding the first chunk of b into the last chunk of a when they fit together so edits don't leave slivers behind */
+  static
+  RopeNode* __rope_join (RopeNode* a, RopeNode* b) {
+    RopeNode const* last = __rope_last(a);
+    RopeNode const* first = b;
+    while (first != NULL && first->left != NULL) first = first->left;
+
+    if (last != NULL && first != NULL && last->length + first->length <= Rope::CHUNK_CAPACITY) {
+      RopeNode* popped;
+      b = __rope_pop_first(b, popped);
+      __rope_append_last(a, popped->bytes, popped->length);
+      free(popped);
+    }
+
+    return __rope_merge(a, b);
+  }
+
+  static
+  void __rope_copy_out (RopeNode const* node, uint8_t* out, size_t& offset) {
+    while (node != NULL) {
+      __rope_copy_out(node->left, out, offset);
+      memcpy(out + offset, node->bytes, node->length);
+      offset += node->length;
+      node = node->right;
+    }
+  }
+
+  /* Build a Rope by passing every grapheme of another through a case mapping, one chunk at a time */
+  static
+  Rope __rope_map (Rope const& src, int32_t (*map) (int32_t)) {
+    Rope out;
+    uint8_t chunk [Rope::CHUNK_CAPACITY];
+    size_t length = 0;
+
+    for (auto [ i, c ] : src) {
+      if (length + 4 > Rope::CHUNK_CAPACITY) {
+        out.insert(StringView { chunk, length });
+        length = 0;
+      }
+
+      length += utf8::encode(map(c), chunk + length);
+    }
+
+    if (length > 0) out.insert(StringView { chunk, length });
+
+    return out;
+  }
+
+
+  StringIteratorResult RopeIterator::operator * () const {
+    return { index, __to_int_bounded(node->bytes + offset, node->length - offset) };
+  }
+
+  RopeIterator& RopeIterator::operator ++ () {
+    index ++;
+    offset += __lead_size(node->bytes[offset]);
+
+    if (offset >= node->length) {
+      size_t local = index;
+      node = __rope_locate(rope->root, local);
+      offset = 0;
+    }
+
+    return *this;
+  }
+
+  bool RopeIterator::operator != (RopeIterator const& other) const {
+    return index < other.index;
+  }
+
+
+  RopeIterator Rope::begin () const {
+    size_t local = 0;
+    return { 0, this, __rope_locate(root, local), 0 };
+  }
+
+  RopeIterator Rope::end () const {
+    return { length(), this, NULL, 0 };
+  }
+
+  size_t Rope::length () const {
+    return __rope_chars(root);
+  }
+
+  size_t Rope::byte_length () const {
+    return __rope_bytes(root);
+  }
+
+  size_t Rope::newline_count () const {
+    return __rope_newlines(root);
+  }
+
+  int32_t Rope::char_at (size_t index) const {
+    RopeNode const* node = __rope_locate(root, index);
+
+    if (node == NULL) return 0;
+
+    size_t offset = __chunk_offset(node->bytes, node->length, index);
+
+    return __to_int_bounded(node->bytes + offset, node->length - offset);
+  }
+
+  size_t Rope::line_start (size_t line) const {
+    if (line == 0) return 0;
+    if (line > newline_count()) return length();
+
+    RopeNode const* node = root;
+    size_t before = 0;
+
+    for (;;) {
+      size_t left_newlines = __rope_newlines(node->left);
+
+      if (line <= left_newlines) {
+        node = node->left;
+        continue;
+      }
+
+      line -= left_newlines;
+      before += __rope_chars(node->left);
+
+      if (line <= node->newlines) {
+        uint8_t const* bytes = node->bytes;
+        uint8_t const* end = bytes + node->length;
+
+        while (line -- > 0) bytes = (uint8_t const*) memchr(bytes, '\n', end - bytes) + 1;
+
+        return before + __char_count(node->bytes, bytes - node->bytes, false);
+      }
+
+      line -= node->newlines;
+      before += node->chars;
+      node = node->right;
+    }
+  }
 
-    while (new_capacity < required_capacity) new_capacity *= 2;
 
-    if (new_capacity > byte_capacity) {
-      byte_capacity = new_capacity;
+  void Rope::insert (int32_t c) {
+    insert_at(SIZE_MAX, c);
+  }
 
-      if (bytes == NULL) bytes = (uint8_t*) malloc(byte_capacity);
-      else bytes = (uint8_t*) realloc(bytes, byte_capacity);
+  void Rope::insert_at (size_t index, StringView src) {
+    if (src.byte_length == 0) return;
 
-      if (bytes == NULL) {
-        printf("Out of memory or other null pointer error while growing String allocation\n");
-        abort();
-      }
+    size_t total = length();
+    if (index > total) index = total;
+
+    if (src.byte_length <= CHUNK_CAPACITY) {
+      size_t chars = __char_count(src.bytes, src.byte_length, false);
+      size_t newlines = __count_newlines(src.bytes, src.byte_length);
+
+      if (__rope_insert_in_place(root, index, src, chars, newlines)) return;
     }
+
+    RopeNode* left;
+    RopeNode* right;
+    __rope_split(root, index, left, right, seed);
+
+    root = __rope_join(__rope_join(left, __rope_build(src.bytes, src.byte_length, seed)), right);
   }
 
+  void Rope::insert_at (size_t index, int32_t c) {
+    uint8_t bytes [4];
+    size_t length = utf8::encode(c, bytes);
+    insert_at(index, StringView { bytes, length });
+  }
 
-  void String::insert (uint8_t const* str, size_t length) {
-    if (length == 0) length = utf8::byte_count(str);
+  void Rope::remove (size_t index, size_t count) {
+    size_t total = length();
 
-    grow_allocation(length);
+    if (index >= total || count == 0) return;
+    if (count > total - index) count = total - index;
 
-    memcpy(bytes + byte_length, str, length);
+    size_t bytes, newlines;
+    if (__rope_remove_in_place(root, index, count, bytes, newlines)) return;
 
-    byte_length += length;
+    RopeNode* left;
+    RopeNode* middle;
+    RopeNode* right;
+    __rope_split(root, index, left, right, seed);
+    __rope_split(right, count, middle, right, seed);
+    __rope_free(middle);
 
-    bytes[byte_length] = 0;
+    root = __rope_join(left, right);
   }
 
-  void String::insert (char const* str, size_t length) {
-    insert((uint8_t const*) str, length);
+
+  String Rope::to_string () const {
+    size_t total = byte_length();
+
+    if (total == 0) return { };
+
+    String out { total };
+    __rope_copy_out(root, out.bytes, out.byte_length);
+    out.bytes[out.byte_length] = 0;
+
+    // a Rope counts NUL bytes as graphemes, where a String's count ends at the first one
+    out.char_length = memchr(out.bytes, 0, out.byte_length) == NULL? length() : String::UNKNOWN_LENGTH;
+
+    return out;
   }
 
-  void String::insert (int32_t c) {
-    size_t length = utf8::char_size(c);
+  Rope Rope::to_lowercase () const {
+    return __rope_map(*this, utf8::to_lowercase);
+  }
 
-    grow_allocation(length);
+  Rope Rope::to_uppercase () const {
+    return __rope_map(*this, utf8::to_uppercase);
+  }
 
-    if (length == 1) {
-      bytes[byte_length ++] = c;
-    } else if (length == 2) {
-      bytes[byte_length ++] = 192 + (c >> 6);
-      bytes[byte_length ++] = 128 + (c & 63);
-    } else if (length == 3) {
-      bytes[byte_length ++] = 224 + (c >> 12);
-      bytes[byte_length ++] = 128 + ((c >> 6) & 63);
-      bytes[byte_length ++] = 128 + (c & 63);
-    } else if (length == 4) {
-      bytes[byte_length ++] = 240 + (c >> 18);
-      bytes[byte_length ++] = 128 + ((c >> 12) & 63);
-      bytes[byte_length ++] = 128 + ((c >> 6) & 63);
-      bytes[byte_length ++] = 128 + (c & 63);
+
+  void Rope::dispose () {
+    __rope_free(root);
+    root = NULL;
+  }
+
+  void Rope::move (Rope& source) {
+    if (&source == this) return;
+
+    dispose();
+    root = source.root;
+    seed = source.seed;
+    source.root = NULL;
+  }
+
+
+  MappedFile MappedFile::from_file (char const* file_name) {
+    FILE* f;
+
+    #ifdef _WIN32
+      f = NULL;
+      fopen_s(&f, file_name, "rb");
+    #else
+      f = fopen(file_name, "rb");
+    #endif
+
+    if (f == NULL) {
+      printf("Error reading file \"%s\"\n", file_name);
+      abort();
     }
 
-    bytes[byte_length] = 0;
+    MappedFile out = from_stream(f);
+
+    fclose(f);
+
+    return out;
   }
 
+  MappedFile MappedFile::from_stream (FILE* f) {
+    MappedFile out;
+    size_t size;
+
+    if (__stream_size(f, size) && size > 0) {
+      #ifdef _WIN32
+        void* mapping = Windows::CreateFileMappingA((void*) _get_osfhandle(_fileno(f)), NULL, Windows::PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL) {
+          void* view = Windows::MapViewOfFile(mapping, Windows::FILE_MAP_READ, 0, 0, size);
+
+          // the view keeps the mapping alive on its own
+          Windows::CloseHandle(mapping);
+
+          if (view != NULL) {
+            out.bytes = (uint8_t const*) view;
+            out.byte_length = size;
+            out.is_mapped = true;
+            return out;
+          }
+        }
+      #else
+        void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+        if (view != MAP_FAILED) {
+          #ifdef MADV_SEQUENTIAL
+            madvise(view, size, MADV_SEQUENTIAL);
+          #endif
+
+          out.bytes = (uint8_t const*) view;
+          out.byte_length = size;
+          out.is_mapped = true;
+          return out;
+        }
+      #endif
+    }
 
-  void String::insert_at (size_t index, uint8_t const* seg, size_t length) {
-    if (index >= utf8::char_count(bytes)) return insert(seg, length);
+    String buffer;
+    __read_stream(f, buffer, "<stream>");
 
-    if (length == 0) length = utf8::byte_count(seg);
+    out.byte_length = buffer.byte_length;
+    out.bytes = buffer.byte_length > 0? buffer.release() : NULL;
 
-    grow_allocation(length);
+    return out;
+  }
 
-    size_t offset = utf8::byte_offset(bytes, index);
+  void MappedFile::dispose () {
+    if (bytes != NULL) {
+      if (is_mapped) {
+        #ifdef _WIN32
+          Windows::UnmapViewOfFile(bytes);
+        #else
+          munmap((void*) bytes, byte_length);
+        #endif
+      } else {
+        free((void*) bytes);
+      }
+    }
 
-    memmove(bytes + offset + length, bytes + offset, byte_length - offset);
+    bytes = NULL;
+    byte_length = 0;
+    is_mapped = false;
+  }
 
-    memcpy(bytes + offset, seg, length);
+  void MappedFile::move (MappedFile& source) {
+    if (&source == this) return;
 
-    byte_length += length;
+    dispose();
+    bytes = source.bytes;
+    byte_length = source.byte_length;
+    is_mapped = source.is_mapped;
+
+    source.bytes = NULL;
+    source.dispose();
   }
 
-  void String::insert_at (size_t index, char const* str, size_t length) {
-    insert_at(index, (uint8_t const*) str, length);
+
+  /* Read more of a Reader's stream after the bytes it holds, moving those to the front of the buffer first and growing it if it is full */
+  static
+  bool __reader_fill (Reader& r) {
+    if (r.eof) return false;
+
+    if (r.start > 0) {
+      memmove(r.buffer, r.buffer + r.start, r.end - r.start);
+      r.end -= r.start;
+      r.start = 0;
+    }
+
+    if (r.end == r.capacity) {
+      r.capacity *= 2;
+      r.buffer = (uint8_t*) realloc(r.buffer, r.capacity);
+
+      if (r.buffer == NULL) {
+        printf("Out of memory or other null pointer error while growing Reader buffer\n");
+        abort();
+      }
+    }
+
+    size_t wanted = r.capacity - r.end;
+    size_t read = fread(r.buffer + r.end, 1, wanted, r.file);
+
+    r.end += read;
+
+    if (read < wanted) {
+      r.eof = true;
+      r.failed = ferror(r.file) != 0;
+    }
+
+    return read > 0;
   }
 
-  void String::insert_at (size_t index, int32_t c) {
-    if (index >= utf8::char_count(bytes)) return insert(c);
+  static inline
+  void __reader_consume (Reader& r, size_t length) {
+    r.start += length;
+    r.position += length;
+  }
 
-    size_t length = utf8::char_size(c);
+  static inline
+  ReadStatus __reader_end (Reader const& r) {
+    return r.failed? ReadStatus::IoError : ReadStatus::End;
+  }
 
-    grow_allocation(length);
+  Reader::Reader (FILE* in_file, size_t buffer_size)
+  : file(in_file)
+  , capacity(buffer_size > 4? buffer_size : 4)
+  {
+    buffer = (uint8_t*) malloc(capacity);
 
-    size_t offset = utf8::byte_offset(bytes, index);
+    if (buffer == NULL) {
+      printf("Out of memory or other null pointer error while creating Reader buffer\n");
+      abort();
+    }
+  }
 
-    memmove(bytes + offset + length, bytes + offset, byte_length - offset);
+  ReadStatus Reader::read_char (int32_t& c) {
+    while (end - start < 4 && __reader_fill(*this)) { }
 
-    if (length == 1) {
-      bytes[offset] = c;
-    } else if (length == 2) {
-      bytes[offset + 0] = 192 + (c >> 6);
-      bytes[offset + 1] = 128 + (c & 63);
-    } else if (length == 3) {
-      bytes[offset + 0] = 224 + (c >> 12);
-      bytes[offset + 1] = 128 + ((c >> 6) & 63);
-      bytes[offset + 2] = 128 + (c & 63);
-    } else if (length == 4) {
-      bytes[offset + 0] = 240 + (c >> 18);
-      bytes[offset + 1] = 128 + ((c >> 12) & 63);
-      bytes[offset + 2] = 128 + ((c >> 6) & 63);
-      bytes[offset + 3] = 128 + (c & 63);
+    if (start == end) return __reader_end(*this);
+
+    uint8_t const* bytes = buffer + start;
+    size_t size = __lead_size(*bytes);
+    ValidationResult result = utf8::validate(bytes, size < end - start? size : end - start);
+
+    if (result.is_valid()) {
+      c = utf8::to_int(bytes);
+      __reader_consume(*this, size);
+      return ReadStatus::Ok;
     }
 
-    byte_length += length;
+    c = 0xFFFD;
+    error = { result.error, position + result.offset };
+
+    // the buffer holds at least 4 bytes until the end of input, so only the last sequence can be cut off
+    if (result.error == ValidationError::Truncated) {
+      __reader_consume(*this, end - start);
+      return ReadStatus::Truncated;
+    }
+
+    __reader_consume(*this, result.offset + 1);
+
+    return ReadStatus::Malformed;
   }
 
+  ReadStatus Reader::read_line (StringView& line) {
+    size_t scanned = 0;
 
-  void String::remove (size_t index, size_t count) {
-    size_t base = utf8::byte_offset(bytes, index);
-    size_t end = utf8::byte_offset(bytes, index + count);
+    for (;;) {
+      uint8_t const* newline = (uint8_t const*) memchr(buffer + start + scanned, '\n', end - start - scanned);
+
+      if (newline != NULL) {
+        size_t length = newline - (buffer + start);
+        line = { buffer + start, length > 0 && newline[-1] == '\r'? length - 1 : length };
+        __reader_consume(*this, length + 1);
+        return ReadStatus::Ok;
+      }
 
-    memmove(bytes + base, bytes + end, byte_length - end);
+      scanned = end - start;
 
-    byte_length -= end - base;
+      if (!__reader_fill(*this)) {
+        if (start == end) return __reader_end(*this);
+
+        line = { buffer + start, end - start };
+        __reader_consume(*this, end - start);
+        return ReadStatus::Ok;
+      }
+    }
   }
 
+  ReadStatus Reader::read_chunk (StringView& chunk) {
+    ValidationResult result;
 
-  void String::insert_fmt_va (uint8_t const* fmt, va_list args) {
-    va_list args_b;
+    for (;;) {
+      result = utf8::validate(buffer + start, end - start);
 
-    va_copy(args_b, args);
+      // a sequence cut off by the end of the buffer is only an error if there is nothing left to read
+      if (start < end && (eof || result.error != ValidationError::Truncated || result.offset > 0)) break;
+      if (!__reader_fill(*this) && start == end) return __reader_end(*this);
+    }
 
-    int length = vsnprintf(NULL, 0, (char const*) fmt, args_b);
+    chunk = { buffer + start, result.offset };
 
-    va_end(args_b);
+    if (result.is_valid() || (result.error == ValidationError::Truncated && !eof)) {
+      __reader_consume(*this, result.offset);
+      return ReadStatus::Ok;
+    }
 
-    grow_allocation(length);
+    error = { result.error, position + result.offset };
 
-    vsnprintf((char*) bytes + byte_length, length + 1, (char const*) fmt, args);
+    if (result.error == ValidationError::Truncated) {
+      __reader_consume(*this, end - start);
+      return ReadStatus::Truncated;
+    }
 
-    byte_length += length;
-    bytes[byte_length] = 0;
+    __reader_consume(*this, result.offset + 1);
+
+    return ReadStatus::Malformed;
   }
 
-  void String::insert_fmt_va (char const* fmt, va_list args) {
-    insert_fmt_va((uint8_t const*) fmt, args);
+  void Reader::dispose () {
+    free(buffer);
+    buffer = NULL;
+    capacity = 0;
+    start = 0;
+    end = 0;
   }
 
-  void String::insert_fmt (uint8_t const* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    insert_fmt_va(fmt, args);
-    va_end(args);
+
+  /* Hand the buffer of a Writer to its stream, followed by an optional span that didn't fit in the buffer */
+  static
+  bool __writer_drain (Writer& w, uint8_t const* extra = NULL, size_t extra_length = 0) {
+    if (w.failed) return false;
+
+    #ifndef _WIN32
+      // big spans go out with the buffer in one writev, straight to the descriptor so stdio doesn't copy them again
+      if (extra_length > 0 && fflush(w.file) == 0) {
+        iovec parts [2] = { { w.buffer, w.length }, { (void*) extra, extra_length } };
+        iovec* part = w.length > 0? parts : parts + 1;
+        int count = w.length > 0? 2 : 1;
+
+        while (count > 0) {
+          ssize_t written = writev(fileno(w.file), part, count);
+
+          if (written < 0) {
+            if (errno == EINTR) continue;
+            w.failed = true;
+            return false;
+          }
+
+          while (count > 0 && (size_t) written >= part->iov_len) {
+            written -= part->iov_len;
+            ++ part;
+            -- count;
+          }
+
+          if (count > 0) {
+            part->iov_base = (uint8_t*) part->iov_base + written;
+            part->iov_len -= written;
+          }
+        }
+
+        w.length = 0;
+        return true;
+      }
+    #endif
+
+    if (w.length > 0 && fwrite(w.buffer, 1, w.length, w.file) != w.length) w.failed = true;
+    if (extra_length > 0 && fwrite(extra, 1, extra_length, w.file) != extra_length) w.failed = true;
+
+    w.length = 0;
+
+    return !w.failed;
   }
 
-  void String::insert_fmt (char const* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    insert_fmt_va(fmt, args);
-    va_end(args);
+
+  Writer::Writer (FILE* in_file, size_t buffer_size)
+  : file(in_file)
+  , capacity(buffer_size > 4? buffer_size : 4)
+  {
+    buffer = (uint8_t*) malloc(capacity);
+
+    if (buffer == NULL) {
+      printf("Out of memory or other null pointer error while creating Writer buffer\n");
+      abort();
+    }
   }
 
+  bool Writer::put_char (int32_t c) {
+    if (capacity - length < 4 && !__writer_drain(*this)) return false;
 
-  void String::insert_fmt_at_va (size_t index, uint8_t const* fmt, va_list args) {
-    if (index >= utf8::char_count(bytes)) return insert_fmt_va(fmt, args);
+    length += utf8::encode(c, buffer + length);
 
-    va_list args_b;
+    return !failed;
+  }
 
-    va_copy(args_b, args);
+  bool Writer::write (StringView src) {
+    if (src.byte_length <= capacity - length) {
+      memcpy(buffer + length, src.bytes, src.byte_length);
+      length += src.byte_length;
+      return !failed;
+    }
 
-    int length = vsnprintf(NULL, 0, (char const*) fmt, args_b);
+    if (src.byte_length >= capacity) return __writer_drain(*this, src.bytes, src.byte_length);
 
-    va_end(args_b);
+    if (!__writer_drain(*this)) return false;
 
-    grow_allocation(length + 1);
+    memcpy(buffer, src.bytes, src.byte_length);
+    length = src.byte_length;
 
-    size_t offset = utf8::byte_offset(bytes, index);
+    return true;
+  }
 
-    uint8_t* ptr = bytes + offset;
+  bool Writer::write (int32_t const* utf32, size_t count) {
+    while (count > 0) {
+      size_t fits = (capacity - length) / 4;
 
-    uint8_t* dest = ptr + length + 1;
-    uint8_t* dest1 = dest - 1;
-    size_t move_length = byte_length - offset;
-    memmove(dest, ptr, move_length); // this double move really sucks but vsnprintf writes a null terminator
+      if (fits == 0) {
+        if (!__writer_drain(*this)) return false;
+        continue;
+      }
 
-    vsnprintf((char*) ptr, length + 1, (char const*) fmt, args);
-    memmove(dest1, dest, move_length);
+      if (fits > count) fits = count;
 
-    byte_length += length;
-    bytes[byte_length] = 0;
+      length += encode_from_utf32(utf32, fits, buffer + length);
+      utf32 += fits;
+      count -= fits;
+    }
+
+    return !failed;
   }
 
-  void String::insert_fmt_at_va (size_t index, char const* fmt, va_list args) {
-    insert_fmt_at_va(index, (uint8_t const*) fmt, args);
+  bool Writer::flush () {
+    if (!__writer_drain(*this)) return false;
+
+    if (fflush(file) != 0) failed = true;
+
+    return !failed;
   }
 
-  void String::insert_fmt_at (size_t index, uint8_t const* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    insert_fmt_at_va(index, fmt, args);
-    va_end(args);
+  void Writer::dispose () {
+    if (buffer != NULL) flush();
+
+    free(buffer);
+    buffer = NULL;
+    capacity = 0;
+    length = 0;
   }
 
-  void String::insert_fmt_at (size_t index, char const* fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    insert_fmt_at_va(index, fmt, args);
-    va_end(args);
+
+  struct Arena::Block {
+    Block* next;
+    size_t capacity; // Usable bytes following the header
+    size_t used;
+    size_t last; // Offset of the most recent allocation, which reallocate can resize in place
+  };
+
+  static_assert(sizeof(Arena::Block) % Arena::ALIGNMENT == 0, "Arena blocks must keep their data aligned");
+
+  static inline
+  uint8_t* __block_data (Arena::Block* block) {
+    return (uint8_t*) (block + 1);
   }
 
+  static inline
+  size_t __arena_round (size_t size) {
+    return size > 0? (size + Arena::ALIGNMENT - 1) & ~(Arena::ALIGNMENT - 1) : Arena::ALIGNMENT;
+  }
 
-  String String::to_lowercase () const {
-    String out { byte_length };
+  static
+  void* __arena_allocate (void* user, size_t size) {
+    return ((Arena*) user)->allocate(size);
+  }
 
-    for (auto [ i, c ] : *this) out.insert(utf8proc_tolower(c));
+  static
+  void* __arena_reallocate (void* user, void* ptr, size_t old_size, size_t new_size) {
+    return ((Arena*) user)->reallocate(ptr, old_size, new_size);
+  }
 
-    return out;
+  static
+  void __arena_deallocate (void*, void*, size_t) {
+    // arena memory only comes back all at once through reset or dispose
   }
 
-  String String::to_uppercase () const {
-    String out { byte_length };
 
-    for (auto [ i, c ] : *this) out.insert(utf8proc_toupper(c));
+  Arena::Arena (size_t in_block_size)
+  : block_size(in_block_size)
+  , allocator({ this, __arena_allocate, __arena_reallocate, __arena_deallocate })
+  { }
 
-    return out;
+  void* Arena::allocate (size_t size) {
+    size = __arena_round(size);
+
+    if (current == NULL || current->capacity - current->used < size) {
+      Block* next = current != NULL? current->next : NULL;
+
+      // blocks kept by reset are reused in order, anything that doesn't fit gets a new block in front of them
+      if (next != NULL && next->capacity >= size) {
+        next->used = 0;
+        current = next;
+      } else {
+        size_t capacity = block_size > sizeof(Block)? block_size - sizeof(Block) : 0;
+        if (capacity < size) capacity = size;
+
+        Block* block = (Block*) malloc(sizeof(Block) + capacity);
+
+        if (block == NULL) {
+          printf("Out of memory or other null pointer error while growing Arena\n");
+          abort();
+        }
+
+        block->capacity = capacity;
+        block->used = 0;
+
+        if (current != NULL) {
+          block->next = current->next;
+          current->next = block;
+        } else {
+          block->next = blocks;
+          blocks = block;
+        }
+
+        current = block;
+      }
+    }
+
+    current->last = current->used;
+    current->used += size;
+
+    return __block_data(current) + current->last;
   }
 
-  // utf8proc totitle is broken
-  // String String::to_titlecase () const {
-  //   String out { byte_length };
+  void* Arena::reallocate (void* ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL) return allocate(new_size);
 
-  //   for (auto [ i, c ] : *this) out.insert(utf8proc_totitle(c));
+    if (ptr == __block_data(current) + current->last) {
+      size_t end = current->last + __arena_round(new_size);
 
-  //   return out;
-  // }
+      if (end <= current->capacity) {
+        current->used = end;
+        return ptr;
+      }
+    }
 
-  String String::casefold () const {
-    uint8_t* new_bytes = utf8proc_NFKC_Casefold(bytes);
+    void* out = allocate(new_size);
+    memcpy(out, ptr, old_size < new_size? old_size : new_size);
 
-    size_t new_length = utf8::byte_count(new_bytes);
+    return out;
+  }
 
-    size_t new_capacity = DEFAULT_CAPACITY;
-    while (new_capacity < new_length) new_capacity *= 2;
+  void Arena::reset () {
+    current = blocks;
 
-    if (new_capacity > new_length) new_bytes = (uint8_t*) realloc(new_bytes, new_capacity);
+    if (current != NULL) {
+      current->used = 0;
+      current->last = 0;
+    }
+  }
 
-    return { new_bytes, new_length, new_capacity };
+  void Arena::dispose () {
+    while (blocks != NULL) {
+      Block* next = blocks->next;
+      free(blocks);
+      blocks = next;
+    }
+
+    current = NULL;
   }
 }
@@ -11,23 +11,86 @@
 // #define UTF8PROC_STATIC
 // #include "../../extern/utf8proc/utf8proc.h"
 
+// String counts the work it does internally when built with UTF8_STATS defined, which the library and everything including this
+// header must agree on (See utf8::Stats, without it the counting compiles away)
+#ifdef UTF8_STATS
+  #define UTF8_STAT(counter, amount) utf8::count_stat(&utf8::Stats::counter, amount)
+#else
+  #define UTF8_STAT(counter, amount) ((void) 0)
+#endif
+
 
 
 namespace utf8 {
+  /* Instruction sets the vectorized routines can run on */
+  enum class SimdLevel : uint8_t {
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512,
+  };
+
+  /* Get the instruction set used by the vectorized routines (Detected from the CPU on first use) */
+  extern SimdLevel simd_level ();
+
+  /* Force the vectorized routines onto a specific instruction set (Clamped to what the CPU supports) */
+  extern void set_simd_level (SimdLevel level);
+
+
   /* Prepare Windows' console for UTF8 IO */
   extern void setup_console ();
 
-  /* Get the byte size of a given grapheme */
-  extern uint8_t char_size (uint8_t const* c);
+  /* Get the byte size of a given grapheme (Stray continuation and invalid bytes count as 1) */
+  constexpr uint8_t char_size (uint8_t const* c) {
+    return *c < 0xC0? 1 : *c < 0xE0? 2 : *c < 0xF0? 3 : *c < 0xF8? 4 : 1;
+  }
+
+  /* Get the byte size of a given grapheme (A grapheme out of range aborts, or fails to compile in a constant expression) */
+  constexpr uint8_t char_size (int32_t c) {
+    if (c >= 1114112 or c < 0) {
+      printf("Char code %d is out of utf8 range (Must be integer 0 - 1114112)\n", c);
+      abort();
+    }
 
-  /* Get the byte size of a given grapheme */
-  extern uint8_t char_size (int32_t c);
+    return c < 128? 1 : c < 2048? 2 : c < 65536? 3 : 4;
+  }
 
   /* Convert a utf8 grapheme to utf32 */
-  extern int32_t to_int (uint8_t const* c);
+  constexpr int32_t to_int (uint8_t const* c) {
+    int32_t out = *c;
+
+    switch (char_size(c)) {
+      case 1: return out;
+      case 2: return ((out & 31) << 6) | (c[1] & 63);
+      case 3: return ((out & 15) << 12) | ((c[1] & 63) << 6) | (c[2] & 63);
+      case 4: return ((out & 7) << 18) | ((c[1] & 63) << 12) | ((c[2] & 63) << 6) | (c[3] & 63);
+    }
+
+    return 0;
+  }
 
   /* Convert a utf32 grapheme to utf8 */
-  extern size_t encode (int32_t c, uint8_t* bytes);
+  constexpr size_t encode (int32_t c, uint8_t* bytes) {
+    size_t length = char_size(c);
+
+    if (length == 1) {
+      bytes[0] = c;
+    } else if (length == 2) {
+      bytes[0] = 192 + (c >> 6);
+      bytes[1] = 128 + (c & 63);
+    } else if (length == 3) {
+      bytes[0] = 224 + (c >> 12);
+      bytes[1] = 128 + ((c >> 6) & 63);
+      bytes[2] = 128 + (c & 63);
+    } else if (length == 4) {
+      bytes[0] = 240 + (c >> 18);
+      bytes[1] = 128 + ((c >> 12) & 63);
+      bytes[2] = 128 + ((c >> 6) & 63);
+      bytes[3] = 128 + (c & 63);
+    }
+
+    return length;
+  }
 
   /* Add a utf8 grapheme to a file */
   extern size_t put_char (uint8_t const* ustr, FILE* f);
@@ -35,13 +98,13 @@ namespace utf8 {
   /* Add a utf32 grapheme to a file as utf8 */
   extern size_t put_char (int32_t c, FILE* f);
 
-  /* Get a utf8 grapheme from a file */
+  /* Get a utf8 grapheme from a file (Reads byte by byte, see Reader for reading whole files) */
   extern size_t get_char (uint8_t* ustr, FILE* f);
 
   /* Get a utf8 grapheme from a file as utf32 */
   extern int32_t get_char (FILE* f);
 
-  /* Offset a pointer to a utf8 grapheme index */
+  /* Offset a pointer to a utf8 grapheme index (Indexes code points, see cluster_offset for indexing by displayed character) */
   extern uint8_t* index_offset (uint8_t* ustr, size_t index);
 
   /* Offset a pointer to a utf8 grapheme index */
@@ -50,7 +113,8 @@ namespace utf8 {
   /* Get the byte offset of a utf8 grapheme index */
   extern size_t byte_offset (uint8_t const* ustr, size_t index);
 
-  /* Get the number of graphemes in a segment of utf8 */
+  /* Get the number of graphemes in a segment of utf8 (These are code points, see cluster_count for what displays as one character,
+   * and Literal for counting at compile time) */
   extern size_t char_count (uint8_t const* ustr, size_t max_byte_length = SIZE_MAX);
 
   /* Get the number of bytes in a utf8 ustr (wrapper for strlen) */
@@ -62,18 +126,104 @@ namespace utf8 {
   extern int32_t char_at (uint8_t const* ustr, size_t index);
 
   /* Determine whether a specific grapheme is a whitespace character */
-  extern bool is_whitespace (int32_t c);
+  constexpr bool is_whitespace (int32_t c) {
+    return (c >= 0x0009 && c <= 0x000D)
+        || c == 0x0020
+        || c == 0x0085
+        || c == 0x00A0
+        || c == 0x1680
+        || (c >= 0x2000 && c <= 0x200A)
+        || c == 0x2028
+        || c == 0x2029
+        || c == 0x202F
+        || c == 0x205F
+        || c == 0x3000
+        ;
+  }
 
   /* Determine whether a specific grapheme is a whitespace character */
-  extern bool is_whitespace (uint8_t const* c);
+  constexpr bool is_whitespace (uint8_t const* c) {
+    return is_whitespace(to_int(c));
+  }
 
-  /* Get the number of visual columns associated with a series of utf8 graphemes */
+  /* Get the number of visual columns associated with a series of utf8 graphemes
+   * (Controls, combining marks and zero width formatting like ZWJ count 0, East Asian wide characters and emoji count 2,
+   * everything else counts 1, as does each byte of malformed utf8, the same as the U+FFFD it would be shown as) */
   extern size_t column_count (uint8_t const* ustr, size_t max_byte_length = SIZE_MAX);
 
-  /* Get the number of visual columns associated with a utf32 grapheme */
+  /* Get the number of visual columns associated with a utf32 grapheme (Looked up in a table built from utf8proc on first use) */
   extern size_t column_count (int32_t c);
 
 
+  /* Kinds of malformed utf8 reported by validate */
+  enum class ValidationError : uint8_t {
+    None,
+    UnexpectedContinuation, // Continuation byte with no lead byte before it
+    MissingContinuation,    // Lead byte followed by too few continuation bytes
+    Truncated,              // Lead byte whose sequence runs past the end of the input
+    Overlong,               // Sequence longer than needed for its value (Includes 0xC0 and 0xC1)
+    Surrogate,              // Encoded UTF-16 surrogate half (U+D800 - U+DFFF)
+    TooLarge,               // Value above U+10FFFF (Includes 0xF5 - 0xF7)
+    InvalidByte,            // Byte that never appears in utf8 (0xF8 - 0xFF)
+  };
+
+  /* Outcome of validate, offset is the first byte of the first malformed sequence, or the input length if there is none */
+  struct ValidationResult {
+    ValidationError error;
+    size_t offset;
+
+    bool is_valid () const {
+      return error == ValidationError::None;
+    }
+  };
+
+  /* Get a readable name for a ValidationError */
+  extern char const* error_name (ValidationError error);
+
+  /* Check that a segment of bytes is well formed utf8, locating the first error if not (NUL bytes are valid) */
+  extern ValidationResult validate (uint8_t const* bytes, size_t byte_length);
+
+  /* Check that a segment of bytes is well formed utf8, locating the first error if not (NUL bytes are valid) */
+  extern ValidationResult validate (char const* bytes, size_t byte_length);
+
+  /* Check that a ustr is well formed utf8, locating the first error if not */
+  extern ValidationResult validate (uint8_t const* ustr);
+
+  /* Determine whether a segment of bytes is well formed utf8 */
+  inline bool is_valid (uint8_t const* bytes, size_t byte_length) {
+    return validate(bytes, byte_length).is_valid();
+  }
+
+
+  /* Get the number of utf32 graphemes decode_to_utf32 will produce for a segment of utf8 (NUL bytes are decoded, not terminators) */
+  extern size_t utf32_length (uint8_t const* src, size_t byte_length);
+
+  /* Get the number of bytes encode_from_utf32 will produce for a series of utf32 graphemes */
+  extern size_t utf8_length (int32_t const* src, size_t count);
+
+  /* Convert a segment of utf8 to utf32, returning the number of graphemes written (dst needs room for utf32_length).
+   * Decodes the same way to_int does, a sequence cut off by the end of the segment becomes U+FFFD */
+  extern size_t decode_to_utf32 (uint8_t const* src, size_t byte_length, int32_t* dst);
+
+  /* Convert a series of utf32 graphemes to utf8, returning the number of bytes written (dst needs room for utf8_length, no NUL is added) */
+  extern size_t encode_from_utf32 (int32_t const* src, size_t count, uint8_t* dst);
+
+
+  /* Convert a utf32 grapheme to its lowercase equivalent (Looked up in a table built from utf8proc on first use) */
+  extern int32_t to_lowercase (int32_t c);
+
+  /* Convert a utf32 grapheme to its uppercase equivalent (Looked up in a table built from utf8proc on first use) */
+  extern int32_t to_uppercase (int32_t c);
+
+  /* Convert a segment of utf8 to lowercase into a buffer, returning the byte length of the whole result like snprintf
+   * (At most dst_capacity bytes are written, ending on a sequence boundary, and no NUL is added) */
+  extern size_t to_lowercase (uint8_t const* src, size_t byte_length, uint8_t* dst, size_t dst_capacity);
+
+  /* Convert a segment of utf8 to uppercase into a buffer, returning the byte length of the whole result like snprintf
+   * (At most dst_capacity bytes are written, ending on a sequence boundary, and no NUL is added) */
+  extern size_t to_uppercase (uint8_t const* src, size_t byte_length, uint8_t* dst, size_t dst_capacity);
+
+
   /* Wrapper for index and value returned by StringIterator */
   struct StringIteratorResult {
     size_t i;
@@ -81,7 +231,7 @@ namespace utf8 {
   };
 
 
-  /* Simple index + value pair iterator for String */
+  /* Simple index + value pair iterator for String (Iteration stops on the byte position of the end iterator, its index is not compared) */
   struct StringIterator {
     size_t index = 0;
     uint8_t const* bytes = NULL;
@@ -94,14 +244,191 @@ namespace utf8 {
   };
 
 
+  /* Byte offsets of every String::CHAR_INDEX_STRIDE'th grapheme of a String, offsets[k] is where grapheme k * CHAR_INDEX_STRIDE starts */
+  struct CharIndex {
+    size_t* offsets = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool complete = false; // Whether offsets reach the end of the String
+  };
+
+
+  /* Memory source for a String's bytes and char_index (All three functions must be set, user is passed back to each of them) */
+  struct Allocator {
+    void* user = NULL;
+    void* (*allocate) (void* user, size_t size) = NULL;
+    void* (*reallocate) (void* user, void* ptr, size_t old_size, size_t new_size) = NULL;
+    void (*deallocate) (void* user, void* ptr, size_t size) = NULL;
+  };
+
+
+  /* Bump allocator handing out memory from large blocks, which is all reclaimed at once by reset or dispose
+   * (Not thread safe, give each thread its own Arena, and Strings using it must not outlive it) */
+  struct Arena {
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+    /* Alignment of every allocation made from an Arena */
+    static constexpr size_t ALIGNMENT = 16;
+
+    struct Block;
+
+    Block* blocks = NULL;
+    Block* current = NULL;
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+
+    /* Allocator drawing from this Arena, pass its address to String (Freeing through it is a no-op) */
+    Allocator allocator;
+
+    /* Create an empty Arena, blocks are allocated on first use */
+    Arena (size_t in_block_size = DEFAULT_BLOCK_SIZE);
+
+    Arena (Arena const&) = delete;
+    Arena& operator = (Arena const&) = delete;
+
+    /* Wraps dispose for automatic clean up when going out of scope */
+    ~Arena () {
+      dispose();
+    }
+
+    /* Get some memory from an Arena */
+    void* allocate (size_t size);
+
+    /* Resize memory from an Arena, in place if it was the most recent allocation and still fits */
+    void* reallocate (void* ptr, size_t old_size, size_t new_size);
+
+    /* Make all the memory of an Arena available again in O(1), keeping its blocks for reuse */
+    void reset ();
+
+    /* Free all the blocks of an Arena */
+    void dispose ();
+  };
+
+
+  /* Counters of the work Strings do behind their methods, kept per thread while built with UTF8_STATS (All 0 otherwise) */
+  struct Stats {
+    size_t allocations = 0; // Buffers got from __allocate for bytes, shared buffers and char_indexes
+    size_t reallocations = 0; // Buffers resized, mostly by grow_allocation doubling
+    size_t allocated_bytes = 0; // Bytes of the allocations plus the growth of the reallocations
+    size_t moves = 0; // memmoves shifting bytes of a String in insert_at, remove, insert_fmt_at_va, trim and collapse_whitespace
+    size_t moved_bytes = 0; // Bytes shifted by those memmoves
+    size_t rescans = 0; // Full char_count passes over a String whose char_length was unknown
+    size_t rescanned_bytes = 0; // Bytes counted by those passes
+    size_t format_passes = 0; // vsnprintf calls of the insert_fmt methods, two for each insert
+  };
+
+  /* Counters attributed to the call sites under one tag */
+  struct TaggedStats {
+    char const* tag;
+    Stats stats;
+  };
+
+  /* Whether the library counts Stats at all */
+  #ifdef UTF8_STATS
+    static constexpr bool STATS_ENABLED = true;
+  #else
+    static constexpr bool STATS_ENABLED = false;
+  #endif
+
+  /* Number of distinct tags kept per thread (Work under further tags only counts toward the totals) */
+  static constexpr size_t MAX_STATS_TAGS = 64;
+
+  /* Add to a counter of the calling thread and its current tag (Used through UTF8_STAT) */
+  extern void count_stat (size_t Stats::* counter, size_t amount);
+
+  /* Get the counters of the calling thread since it started or last called reset_stats */
+  extern Stats stats_snapshot ();
+
+  /* Copy up to capacity of the calling thread's counters per tag, in order of first use, returning the number of tags it has */
+  extern size_t tagged_stats_snapshot (TaggedStats* out, size_t capacity);
+
+  /* Zero the counters of the calling thread (Tags are kept, so StatsTags in scope stay valid) */
+  extern void reset_stats ();
+
+  /* Attribute the work of the calling thread to a tag until the StatsTag goes out of scope
+   * (Work counts toward the innermost tag only, and tags are told apart by address, so string literals are the intended kind) */
+  struct StatsTag {
+    #ifdef UTF8_STATS
+      Stats* previous;
+
+      StatsTag (char const* tag);
+      ~StatsTag ();
+
+      StatsTag (StatsTag const&) = delete;
+      StatsTag& operator = (StatsTag const&) = delete;
+    #else
+      constexpr StatsTag (char const*) { }
+    #endif
+  };
+
+
+  /* Reference counted, immutable buffer behind shared Strings (Laid out in front of the bytes it holds) */
+  struct SharedBuffer;
+
+
+  struct StringView;
+
+
+  /* Unicode normalization forms (UAX #15), canonical or compatibility equivalence, composed or decomposed */
+  enum class NormalForm : uint8_t {
+    NFC,
+    NFD,
+    NFKC,
+    NFKD,
+  };
+
+
+  /* Position of an occurrence found by find or rfind */
+  struct Match {
+    /* Value of both fields when nothing was found */
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+    size_t byte_offset = NOT_FOUND; // Byte offset where the occurrence starts
+    size_t char_index = NOT_FOUND; // Grapheme index of the same place
+
+    /* Determine whether a Match holds an occurrence */
+    bool found () const {
+      return byte_offset != NOT_FOUND;
+    }
+  };
+
+
   /* Utf8 aware String representation for dynamic allocation */
   struct String {
     static constexpr size_t DEFAULT_CAPACITY = 16;
 
+    /* Byte capacity (Including the NUL terminator) of the buffer inside a String, used instead of a heap allocation while the String fits */
+    static constexpr size_t INLINE_CAPACITY = 24;
+
+    /* Graphemes between the entries of a String's char_index */
+    static constexpr size_t CHAR_INDEX_STRIDE = 64;
+
+    /* Byte length below which indexed access just scans from the start instead of building a char_index */
+    static constexpr size_t CHAR_INDEX_THRESHOLD = 256;
+
+    /* Value of char_length while the grapheme count of a String is not known */
+    static constexpr size_t UNKNOWN_LENGTH = SIZE_MAX;
+
     uint8_t* bytes = NULL;
     size_t byte_length = 0;
     size_t byte_capacity = 0;
 
+    /* Where a String gets its memory, NULL for malloc, realloc and free (Must not change while the String holds memory) */
+    Allocator const* allocator = NULL;
+
+    /* Number of graphemes in a String, kept up to date by the mutation methods or counted on demand when UNKNOWN_LENGTH
+     * (Needs clear_caches after editing bytes directly, and stays unknown while the String holds a NUL, which ends the count) */
+    mutable size_t char_length = 0;
+
+    /* Built on demand by indexed access through a non const String so it costs O(CHAR_INDEX_STRIDE) rather than O(n), or all at
+     * once by build_char_index, and patched by the mutation methods (Needs clear_char_index after editing bytes directly) */
+    mutable CharIndex* char_index = NULL;
+
+    /* Set while bytes lives in a SharedBuffer, which copies reference instead of duplicating, and the mutation methods detach from */
+    SharedBuffer* shared = NULL;
+
+    /* Storage bytes points at while a String is short (Moving a String must go through the String methods so bytes follows it) */
+    uint8_t inline_bytes [INLINE_CAPACITY];
+
     /* Create a 0-initialized String */
     String () = default;
 
@@ -109,6 +436,11 @@ namespace utf8 {
     String (size_t init_capacity)
     { grow_allocation(init_capacity); }
 
+    /* Create a String drawing its memory from an Allocator, with an initial capacity */
+    String (Allocator const* in_allocator, size_t init_capacity = 0)
+    : allocator(in_allocator)
+    { grow_allocation(init_capacity); }
+
     /* Create a String from a ustr */
     String (uint8_t const* src)
     { insert(src); }
@@ -125,15 +457,24 @@ namespace utf8 {
     String (char const* src, size_t length)
     { insert((uint8_t const*) src, length); }
 
-    /* Create a copy of a String */
+    /* Create a String from a StringView */
+    String (StringView src);
+
+    /* Create a copy of a String (The copy uses the same allocator, and references the same buffer if it is shared) */
     String (String const& src)
-    { insert(src.bytes, src.byte_length); }
+    : allocator(src.allocator)
+    { assign(src); }
+
+    /* Create a String by taking the data of another, which is left empty */
+    String (String&& src) noexcept
+    { move(src); }
 
     /* Create a String manually by taking ownership of existing data */
     String (uint8_t* in_bytes, size_t in_byte_length, size_t in_byte_capacity)
     : bytes(in_bytes)
     , byte_length(in_byte_length)
     , byte_capacity(in_byte_capacity)
+    , char_length(UNKNOWN_LENGTH)
     { }
 
     /* Wraps dispose for automatic clean up when going out of scope */
@@ -141,6 +482,18 @@ namespace utf8 {
       dispose();
     }
 
+    /* Replace a String with a copy of another (Keeps its own allocator, wrapper for assign) */
+    String& operator = (String const& src) {
+      assign(src);
+      return *this;
+    }
+
+    /* Replace a String with the data of another, which is left empty (Wrapper for move) */
+    String& operator = (String&& src) noexcept {
+      move(src);
+      return *this;
+    }
+
     /* Create a StringIterator representing the start of the String */
     StringIterator begin () const {
       return { 0, bytes };
@@ -148,7 +501,7 @@ namespace utf8 {
 
     /* Create a StringIterator representing the end of the String */
     StringIterator end () const {
-      return { utf8::char_count(bytes), bytes + byte_length };
+      return { 0, bytes + byte_length };
     }
 
     /* Cast to str */
@@ -174,38 +527,108 @@ namespace utf8 {
     }
 
     /* Get the grapheme at an index in a String (Wrapper for char_at) */
+    int32_t operator [] (size_t index) {
+      return char_at(index);
+    }
+
+    /* Get the grapheme at an index in a const String (Wrapper for char_at) */
     int32_t operator [] (size_t index) const {
       return char_at(index);
     }
 
-    /* Get the length of a String in graphemes (Wrapper for char_count) */
+    /* Get the length of a String in graphemes up to its first NUL (Only counts when the cached char_length is unknown) */
     size_t length () const {
-      return utf8::char_count(bytes);
+      if (char_length != UNKNOWN_LENGTH) return char_length;
+
+      UTF8_STAT(rescans, 1);
+      UTF8_STAT(rescanned_bytes, byte_length);
+
+      size_t count = utf8::char_count(bytes, byte_length);
+
+      // the count ends at the first NUL, which graphemes inserted after it wouldn't move, so it is only kept while there is none
+      if (byte_length == 0 || memchr(bytes, 0, byte_length) == NULL) char_length = count;
+
+      return count;
+    }
+
+    /* Get the grapheme at an index in a String */
+    int32_t char_at (size_t index) {
+      return utf8::to_int(bytes + byte_offset(index));
     }
 
-    /* Get the grapheme at an index in a String (Wrapper for utf8::char_at) */
+    /* Get the grapheme at an index in a const String */
     int32_t char_at (size_t index) const {
-      return utf8::char_at(bytes, index);
+      return utf8::to_int(bytes + byte_offset(index));
     }
 
-    /* Get a ustr at a grapheme index (Wrapper for index_offset) */
+    /* Get a ustr at a grapheme index */
+    uint8_t* str_at (size_t index) {
+      return bytes + byte_offset(index);
+    }
+
+    /* Get a ustr at a grapheme index of a const String */
     uint8_t* str_at (size_t index) const {
-      return utf8::index_offset(bytes, index);
+      return bytes + byte_offset(index);
+    }
+
+    /* Get the byte offset of a grapheme index in a String (Uses and extends the char_index on long Strings) */
+    size_t byte_offset (size_t index);
+
+    /* Get the byte offset of a grapheme index in a const String (Uses the char_index if there is one, but never builds it,
+     * so several threads can read the same String) */
+    size_t byte_offset (size_t index) const;
+
+    /* Build the whole char_index of a long String up front, so indexed access through a const String is O(CHAR_INDEX_STRIDE) too */
+    void build_char_index ();
+
+    /* Free the char_index of a String, it is rebuilt on the next indexed access */
+    void clear_char_index () const;
+
+    /* Determine whether a String's bytes live in its inline buffer rather than on the heap */
+    bool is_inline () const {
+      return bytes == inline_bytes;
+    }
+
+    /* Forget the char_length and char_index of a String (Needed after editing bytes directly) */
+    void clear_caches () const {
+      clear_char_index();
+      char_length = UNKNOWN_LENGTH;
+    }
+
+    /* Check that a String is well formed utf8 (Wrapper for utf8::validate) */
+    ValidationResult validate () const {
+      return utf8::validate(bytes, byte_length);
     }
 
 
-    /* Free dynamically allocated memory for a String and zero initialize it again */
+    /* Free dynamically allocated memory for a String and zero initialize it again (The allocator is kept) */
     void dispose ();
 
-    /* Take ownership of a String's internal data and zero initialize it again */
+    /* Take ownership of a String's internal data and zero initialize it again (Free the result through the String's allocator) */
     uint8_t* release ();
 
-    /* Move a String's data into another String */
+    /* Move a String's data into another String, freeing what it held before */
     void move (String& source);
 
+    /* Replace the data of a String with a copy of another's, or a new reference if that one is shared */
+    void assign (String const& src);
+
+
+    /* Move the bytes of a String into a SharedBuffer, so copies of it reference them instead of duplicating
+     * (Short inline Strings are left as they are, and bytes must not be edited directly while shared) */
+    void share ();
+
+    /* Give a String its own copy of the bytes of a SharedBuffer (Done automatically by the mutation methods) */
+    void unshare ();
+
+    /* Determine whether a String's bytes live in a SharedBuffer */
+    bool is_shared () const {
+      return shared != NULL;
+    }
+
 
     /* Load a utf8 file by name and create a String from it */
-    static String from_file (char const* file_name);
+    static String from_file (char const* file_name, Allocator const* allocator = NULL);
 
     /* Store a String to a utf8 file by name */
     void to_file (char const* file_name) const;
@@ -241,6 +664,29 @@ namespace utf8 {
     void remove (size_t index, size_t count = 1);
 
 
+    /* Find the first occurrence of a needle in a String at or after a grapheme index (Resolved through the char_index, see utf8::find) */
+    Match find (StringView needle, size_t from_index = 0) const;
+
+    /* Find the last occurrence of a needle in a String (Counts back from the end for the grapheme index while char_length is known) */
+    Match rfind (StringView needle) const;
+
+    /* Determine whether a needle occurs in a String */
+    bool contains (StringView needle) const;
+
+    /* Get the number of non overlapping occurrences of a needle in a String */
+    size_t count_occurrences (StringView needle) const;
+
+    /* Replace each non overlapping occurrence of a needle in a String, returning how many were replaced (A single pass, in place when
+     * the replacement is no longer than the needle, otherwise into one allocation sized up front. Nothing happens for an empty needle) */
+    size_t replace_all (StringView needle, StringView replacement);
+
+    /* Remove the whitespace (As judged by is_whitespace) at either end of a String in place */
+    void trim ();
+
+    /* Replace each run of whitespace inside a String with a single ' ' and remove the whitespace at either end, in place */
+    void collapse_whitespace ();
+
+
     /* Wrapper for vsnprintf that appends the result to the end of a String */
     void insert_fmt_va (uint8_t const* fmt, va_list args);
 
@@ -271,11 +717,795 @@ namespace utf8 {
     /* Create a new copy of a String with all known graphemes converted to their uppercase equivalent */
     String to_uppercase () const;
 
+    /* Convert all known graphemes of a String to their lowercase equivalent in place (Only reallocates from the first grapheme
+     * whose lowercase form has a different byte size) */
+    void make_lowercase ();
+
+    /* Convert all known graphemes of a String to their uppercase equivalent in place (Only reallocates from the first grapheme
+     * whose uppercase form has a different byte size) */
+    void make_uppercase ();
+
     // utf8proc totitle is broken
     // String to_titlecase () const;
 
     /* Create a new copy of a String with all known graphemes converted to their lowercase equivalent
      * (This is more aggressive than to_lowercase for hashmaps and other things where case is irrelevant) */
     String casefold () const;
+
+    /* Convert a String to a normalization form in place (Returns without allocating when it is already normalized, see utf8::normalize) */
+    void normalize (NormalForm form);
+  };
+
+
+  /* Index + value pair iterator for StringView (Bounded by limit instead of a NUL, a sequence cut off by it reads as U+FFFD) */
+  struct StringViewIterator {
+    size_t index = 0;
+    uint8_t const* bytes = NULL;
+    uint8_t const* limit = NULL;
+
+    StringIteratorResult operator * () const;
+
+    StringViewIterator& operator ++ ();
+
+    bool operator != (StringViewIterator const& other) const;
+  };
+
+
+  /* Non owning pointer + byte length view of some utf8, which needs no NUL terminator (NUL bytes inside it count as graphemes) */
+  struct StringView {
+    uint8_t const* bytes = NULL;
+    size_t byte_length = 0;
+
+    /* Create an empty StringView */
+    StringView () = default;
+
+    /* Create a StringView of a ustr subsection */
+    StringView (uint8_t const* in_bytes, size_t in_byte_length)
+    : bytes(in_bytes)
+    , byte_length(in_byte_length)
+    { }
+
+    /* Create a StringView of a str subsection */
+    StringView (char const* in_bytes, size_t in_byte_length)
+    : bytes((uint8_t const*) in_bytes)
+    , byte_length(in_byte_length)
+    { }
+
+    /* Create a StringView of a whole ustr */
+    StringView (uint8_t const* ustr)
+    : bytes(ustr)
+    , byte_length(ustr != NULL? byte_count(ustr) : 0)
+    { }
+
+    /* Create a StringView of a whole str */
+    StringView (char const* str)
+    : StringView((uint8_t const*) str)
+    { }
+
+    /* Create a StringView of the current contents of a String (Invalidated by changes to the String, explicit so String keeps
+     * converting to ustr for the free functions without ambiguity) */
+    explicit StringView (String const& src)
+    : bytes(src.bytes)
+    , byte_length(src.byte_length)
+    { }
+
+    /* Create a StringViewIterator representing the start of the StringView */
+    StringViewIterator begin () const {
+      return { 0, bytes, bytes + byte_length };
+    }
+
+    /* Create a StringViewIterator representing the end of the StringView */
+    StringViewIterator end () const {
+      return { 0, bytes + byte_length, bytes + byte_length };
+    }
+
+    /* Determine whether a StringView has no bytes */
+    bool is_empty () const {
+      return byte_length == 0;
+    }
+
+    /* Get the grapheme at an index in a StringView (Wrapper for char_at) */
+    int32_t operator [] (size_t index) const {
+      return char_at(index);
+    }
+
+    /* Get the number of graphemes in a StringView (Wrapper for char_count) */
+    size_t length () const;
+
+    /* Get the grapheme at an index in a StringView (0 if the index is past the end) */
+    int32_t char_at (size_t index) const;
+
+    /* Get the byte offset of a grapheme index in a StringView (byte_length if the index is past the end) */
+    size_t byte_offset (size_t index) const;
+
+    /* Get the graphemes from start up to but not including end as another StringView (Both are clamped to the end) */
+    StringView slice (size_t start, size_t end = SIZE_MAX) const;
+
+    /* Get a subsection of a StringView by byte offset and length (Both are clamped to the end, no utf8 boundaries are checked) */
+    StringView byte_slice (size_t offset, size_t length = SIZE_MAX) const {
+      if (offset > byte_length) offset = byte_length;
+      if (length > byte_length - offset) length = byte_length - offset;
+      return { bytes + offset, length };
+    }
+
+    /* Check that a StringView is well formed utf8 (Wrapper for utf8::validate) */
+    ValidationResult validate () const {
+      return utf8::validate(bytes, byte_length);
+    }
+
+    /* Order two StringViews bytewise, which for well formed utf8 is the same as ordering by grapheme (Negative, 0 or positive like strcmp) */
+    int compare (StringView const& other) const;
+
+    /* Compare to another StringView bytewise */
+    bool operator == (StringView const& other) const {
+      return byte_length == other.byte_length && (byte_length == 0 || memcmp(bytes, other.bytes, byte_length) == 0);
+    }
+
+    /* Compare to another StringView bytewise */
+    bool operator != (StringView const& other) const {
+      return !(*this == other);
+    }
+
+    /* Order two StringViews bytewise (Wrapper for compare) */
+    bool operator < (StringView const& other) const {
+      return compare(other) < 0;
+    }
+  };
+
+
+  /* Get the number of graphemes in a StringView (NUL bytes are counted, not terminators) */
+  extern size_t char_count (StringView view);
+
+  /* Get the number of visual columns associated with the graphemes of a StringView (Counted like column_count of a ustr, NUL bytes count 0) */
+  extern size_t column_count (StringView view);
+
+
+  /* A utf8 string literal that is validated, and has its graphemes and columns counted, when it is constructed, which for a constexpr
+   * Literal happens at compile time (Malformed utf8 aborts like validate would report it, or fails to compile in a constant expression) */
+  struct Literal {
+    /* Stands in for the columns of a Literal using graphemes whose widths have changed between versions of utf8proc */
+    static constexpr size_t UNKNOWN_COLUMNS = SIZE_MAX;
+
+    char const* bytes = NULL;
+    size_t byte_length = 0;
+    size_t char_length = 0;
+    size_t columns = 0;
+
+    /* Create a Literal from a string literal (The terminating NUL is not part of it, NUL bytes before it count as graphemes) */
+    template <size_t N>
+    constexpr Literal (char const (&str) [N])
+    : bytes(str)
+    , byte_length(N - 1)
+    {
+      size_t offset = 0;
+
+      while (offset < byte_length) {
+        uint8_t c = (uint8_t) str[offset];
+        size_t size = 1;
+        uint8_t second_min = 0x80;
+        uint8_t second_max = 0xBF;
+        ValidationError second_error = ValidationError::None;
+
+        if (c < 0x80) size = 1;
+        else if (c < 0xC0) fail(ValidationError::UnexpectedContinuation, offset);
+        else if (c < 0xC2) fail(ValidationError::Overlong, offset);
+        else if (c < 0xE0) size = 2;
+        else if (c < 0xF0) {
+          size = 3;
+          if (c == 0xE0) { second_min = 0xA0; second_error = ValidationError::Overlong; }
+          else if (c == 0xED) { second_max = 0x9F; second_error = ValidationError::Surrogate; }
+        } else if (c < 0xF5) {
+          size = 4;
+          if (c == 0xF0) { second_min = 0x90; second_error = ValidationError::Overlong; }
+          else if (c == 0xF4) { second_max = 0x8F; second_error = ValidationError::TooLarge; }
+        }
+        else if (c < 0xF8) fail(ValidationError::TooLarge, offset);
+        else fail(ValidationError::InvalidByte, offset);
+
+        int32_t value = size == 1? c : c & (0x7F >> size);
+
+        for (size_t i = 1; i < size; ++ i) {
+          if (offset + i >= byte_length) fail(ValidationError::Truncated, offset);
+
+          uint8_t b = (uint8_t) str[offset + i];
+
+          if ((b & 0xC0) != 0x80) fail(ValidationError::MissingContinuation, offset);
+          if (i == 1 && (b < second_min || b > second_max)) fail(second_error, offset);
+
+          value = (value << 6) | (b & 63);
+        }
+
+        if (columns != UNKNOWN_COLUMNS) {
+          size_t width = stable_width(value);
+          columns = width == UNKNOWN_COLUMNS? UNKNOWN_COLUMNS : columns + width;
+        }
+
+        ++ char_length;
+        offset += size;
+      }
+    }
+
+    /* Create a StringView of a Literal */
+    operator StringView () const {
+      return { bytes, byte_length };
+    }
+
+    /* Get the number of graphemes in a Literal (Counted at construction) */
+    constexpr size_t length () const {
+      return char_length;
+    }
+
+    /* Get the number of visual columns of a Literal (Counted at construction, or by column_count at run time if they were unknown) */
+    size_t column_count () const {
+      return columns != UNKNOWN_COLUMNS? columns : utf8::column_count(StringView { bytes, byte_length });
+    }
+
+    /* Get the column width of a grapheme in one of the ranges utf8proc has agreed on across versions (Latin, combining diacritics,
+     * kana, the original CJK ideographs, Hangul syllables and fullwidth forms), or UNKNOWN_COLUMNS for anything else */
+    static constexpr size_t stable_width (int32_t c) {
+      if (c < 0x20 || (c >= 0x7F && c <= 0x9F)) return 0;
+      if (c < 0x300) return 1;
+      if (c < 0x370) return 0;
+      if (c >= 0x3041 && c <= 0x3096) return 2;
+      if (c >= 0x3099 && c <= 0x309A) return 0;
+      if (c >= 0x309B && c <= 0x30FF) return 2;
+      if (c >= 0x4E00 && c <= 0x9FA5) return 2;
+      if (c >= 0xAC00 && c <= 0xD7A3) return 2;
+      if (c >= 0xFF01 && c <= 0xFF60) return 2;
+      return UNKNOWN_COLUMNS;
+    }
+
+    /* Report a malformed Literal (Not constexpr, so reaching it during constant evaluation is a compile error) */
+    static void fail (ValidationError error, size_t offset) {
+      printf("Literal is not valid utf8 (%s at byte %zu)\n", error_name(error), offset);
+      abort();
+    }
+  };
+
+
+  /* The parallel functions split a buffer into chunks at points the serial scan is known to step onto, which are found by skipping
+   * continuation bytes and any byte a lead before it would step over, process them on up to thread_count threads (0 for one per
+   * hardware thread) that each claim the next chunk as they finish, and merge the results, which match the serial functions exactly,
+   * malformed input included. Buffers under a few MiB are processed serially */
+
+  /* Get the number of graphemes in a StringView using several threads (See char_count) */
+  extern size_t char_count_parallel (StringView view, size_t thread_count = 0);
+
+  /* Get the number of visual columns of a StringView using several threads (See column_count) */
+  extern size_t column_count_parallel (StringView view, size_t thread_count = 0);
+
+  /* Check that a segment is well formed utf8 using several threads (See validate, the first malformed sequence is the one reported) */
+  extern ValidationResult validate_parallel (uint8_t const* bytes, size_t byte_length, size_t thread_count = 0);
+
+  /* Convert a segment of utf8 to utf32 using several threads, returning the number of graphemes written (See decode_to_utf32,
+   * each chunk is counted first so the prefix sums of the counts place its output) */
+  extern size_t decode_to_utf32_parallel (uint8_t const* src, size_t byte_length, int32_t* dst, size_t thread_count = 0);
+
+  /* Convert a series of utf32 graphemes to utf8 using several threads, returning the number of bytes written (See encode_from_utf32) */
+  extern size_t encode_from_utf32_parallel (int32_t const* src, size_t count, uint8_t* dst, size_t thread_count = 0);
+
+  /* Find the first occurrence of a needle in a StringView at or after a byte offset (The grapheme index of the Match counts from the start
+   * of the StringView. Candidates are filtered on their first and last bytes a vector at a time, and an empty needle is found at from) */
+  extern Match find (StringView haystack, StringView needle, size_t from = 0);
+
+  /* Find the last occurrence of a needle in a StringView (An empty needle is found at the end) */
+  extern Match rfind (StringView haystack, StringView needle);
+
+  /* Determine whether a needle occurs in a StringView */
+  extern bool contains (StringView haystack, StringView needle);
+
+  /* Get the number of non overlapping occurrences of a needle in a StringView, found left to right (0 for an empty needle) */
+  extern size_t count_occurrences (StringView haystack, StringView needle);
+
+  /* Replace each non overlapping occurrence of a needle in a StringView into a buffer, returning the byte length of the whole result like
+   * snprintf (At most capacity bytes are written, ending on a sequence boundary, and no NUL is added. An empty needle replaces nothing) */
+  extern size_t replace_all (StringView src, StringView needle, StringView replacement, uint8_t* dst, size_t capacity);
+
+  /* Determine whether two StringViews are the same once casefolded, without allocating (Agrees with comparing String::casefold results) */
+  extern bool casefold_equal (StringView a, StringView b);
+
+  /* Order two StringViews by their casefolded graphemes in decomposed form, without allocating (0 exactly when casefold_equal) */
+  extern int casefold_compare (StringView a, StringView b);
+
+  /* Get a 64 bit FNV-1a hash of the casefolded form of a StringView, without allocating
+   * (Equal for any two StringViews that are casefold_equal, including a StringView and its String::casefold result) */
+  extern uint64_t casefold_hash (StringView view);
+
+  /* Determine whether a StringView is in a normalization form, without allocating (A quick check passes most graphemes on their own,
+   * only the spans around ones it can't pass are normalized to compare, and malformed bytes are ignored) */
+  extern bool is_normalized (StringView view, NormalForm form);
+
+  /* Normalize a StringView, returning it as it is when it is already normalized, or else a view of storage, which is overwritten
+   * (Only the spans a quick check can't pass go through decomposition and composition, malformed bytes are copied as they are) */
+  extern StringView normalize (StringView view, NormalForm form, String& storage);
+
+
+  inline size_t StringView::length () const {
+    return char_count(*this);
+  }
+
+
+  /* Place in a StringView found by counting columns, see column_position */
+  struct ColumnPosition {
+    size_t byte_offset; // Byte offset of the first grapheme that doesn't fit, or byte_length if they all do
+    size_t char_index; // Grapheme index of that same grapheme
+    size_t columns; // Number of columns taken by the graphemes before it
+  };
+
+  /* Find where the graphemes of a StringView fill a number of columns, in one pass (A wide grapheme that would only partly fit
+   * is left out, and zero width graphemes after the last that fits stay with it, so this also finds the grapheme drawn at a column) */
+  extern ColumnPosition column_position (StringView view, size_t columns);
+
+  /* Get the longest start of a StringView that fits in a number of columns (See column_position) */
+  extern StringView truncate_columns (StringView view, size_t columns);
+
+
+  /* Iterator for the lines of a StringView wrapped to a number of columns, see wrap_columns */
+  struct WrapIterator {
+    uint8_t const* bytes = NULL;
+    size_t byte_length = 0;
+    size_t width = 0;
+    size_t offset = 0; // Byte offset of the current line
+    size_t line_length = 0; // Byte length of the current line, without the whitespace or newline it broke at
+    size_t next = 0; // Byte offset of the line after it
+
+    StringView operator * () const {
+      return { bytes + offset, line_length };
+    }
+
+    WrapIterator& operator ++ ();
+
+    bool operator != (WrapIterator const& other) const {
+      return offset < other.offset;
+    }
+  };
+
+  /* The lines of a StringView wrapped to a number of columns, for use in a range for (See wrap_columns) */
+  struct WrappedLines {
+    StringView view;
+    size_t width;
+
+    WrapIterator begin () const;
+
+    WrapIterator end () const {
+      return { view.bytes, view.byte_length, width, view.byte_length, 0, view.byte_length };
+    }
+  };
+
+  /* Split a StringView into lines of at most a number of columns, in one pass and without allocating.
+   * Lines break at the last whitespace (as judged by is_whitespace) that fits, which is dropped along with the rest of its run,
+   * or mid word when there is none. Newlines always end a line, and a grapheme wider than the whole width gets a line of its own */
+  extern WrappedLines wrap_columns (StringView view, size_t width);
+
+
+  /* What separates the pieces a SplitIterator yields */
+  enum class SplitKind : uint8_t {
+    Whitespace, // Runs of whitespace, see split_whitespace
+    Delimiter,  // Occurrences of a delimiter, see split
+    Lines,      // '\n' or "\r\n", see lines
+  };
+
+  /* Iterator for the pieces of a StringView between separators */
+  struct SplitIterator {
+    uint8_t const* bytes = NULL;
+    size_t byte_length = 0;
+    StringView delimiter;
+    SplitKind kind = SplitKind::Whitespace;
+    size_t offset = 0; // Byte offset of the current piece, byte_length + 1 once past the last
+    size_t piece_length = 0; // Byte length of the current piece
+    size_t next = 0; // Byte offset the search for the piece after it starts from
+
+    StringView operator * () const {
+      return { bytes + offset, piece_length };
+    }
+
+    SplitIterator& operator ++ ();
+
+    bool operator != (SplitIterator const& other) const {
+      return offset < other.offset;
+    }
+  };
+
+  /* The pieces of a StringView between separators, for use in a range for (See split_whitespace, split and lines) */
+  struct SplitPieces {
+    StringView view;
+    StringView delimiter;
+    SplitKind kind;
+
+    SplitIterator begin () const;
+
+    SplitIterator end () const {
+      return { view.bytes, view.byte_length, delimiter, kind, view.byte_length + 1, 0, view.byte_length + 1 };
+    }
+  };
+
+  /* Split a StringView at runs of whitespace (As judged by is_whitespace), lazily and without allocating. Whitespace at either end
+   * makes no empty pieces. ASCII is classified a vector at a time, and only the multi byte sequences that may be spaces are decoded */
+  extern SplitPieces split_whitespace (StringView view);
+
+  /* Split a StringView at each occurrence of a delimiter, lazily and without allocating (Pieces may be empty, n delimiters make
+   * n + 1 pieces, and an empty delimiter makes the whole StringView one piece) */
+  extern SplitPieces split (StringView view, StringView delimiter);
+
+  /* Split a StringView into lines, lazily and without allocating (A line ends at '\n', which is left out along with a '\r' before it
+   * like Reader::read_line does, and one ending the StringView doesn't start another, empty line) */
+  extern SplitPieces lines (StringView view);
+
+  /* Get the part of a StringView without the whitespace at either end */
+  extern StringView trim (StringView view);
+
+
+  /* Byte offsets of every ClusterIndex::STRIDE'th extended grapheme cluster of some text, offsets[k] is where cluster k * STRIDE starts.
+   * Pass one to the cluster functions to have them build it as far as needed and resume from it instead of segmenting from the start
+   * (It belongs to one text, call truncate at the offset of an edit to keep it valid, or clear when switching texts) */
+  struct ClusterIndex {
+    static constexpr size_t STRIDE = 64;
+
+    size_t* offsets = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool complete = false; // Whether offsets reach the end of the text
+
+    /* Create an empty ClusterIndex */
+    ClusterIndex () = default;
+
+    ClusterIndex (ClusterIndex const&) = delete;
+    ClusterIndex& operator = (ClusterIndex const&) = delete;
+
+    /* Wraps dispose for automatic clean up when going out of scope */
+    ~ClusterIndex () {
+      dispose();
+    }
+
+    /* Drop the entries an edit at a byte offset may have moved (Those before it stay, as a break only depends on the text up to it) */
+    void truncate (size_t byte_offset);
+
+    /* Drop all entries, keeping the memory for reuse */
+    void clear () {
+      count = 0;
+      complete = false;
+    }
+
+    /* Free the offsets of a ClusterIndex and zero initialize it again */
+    void dispose ();
+  };
+
+
+  /* Iterator for the extended grapheme clusters of a StringView, see clusters */
+  struct ClusterIterator {
+    uint8_t const* bytes = NULL;
+    size_t byte_length = 0;
+    size_t offset = 0; // Byte offset of the current cluster
+    size_t cluster_length = 0; // Byte length of the current cluster
+
+    StringView operator * () const {
+      return { bytes + offset, cluster_length };
+    }
+
+    ClusterIterator& operator ++ ();
+
+    bool operator != (ClusterIterator const& other) const {
+      return offset < other.offset;
+    }
+  };
+
+  /* The extended grapheme clusters of a StringView, for use in a range for (See clusters) */
+  struct Clusters {
+    StringView view;
+
+    ClusterIterator begin () const;
+
+    ClusterIterator end () const {
+      return { view.bytes, view.byte_length, view.byte_length, 0 };
+    }
+  };
+
+  /* Split a StringView into extended grapheme clusters (UAX #29), the user perceived characters that emoji ZWJ sequences,
+   * flags and base letters with their combining marks each make up, so they are never pulled apart when indexing or editing */
+  extern Clusters clusters (StringView view);
+
+  /* Get the number of extended grapheme clusters in a StringView */
+  extern size_t cluster_count (StringView view);
+
+  /* Get the byte length of the extended grapheme cluster at a byte offset of a StringView, which must be a cluster boundary (0 at the end) */
+  extern size_t cluster_size (StringView view, size_t byte_offset);
+
+  /* Get the byte offset of an extended grapheme cluster index in a StringView (byte_length if the index is past the end) */
+  extern size_t cluster_offset (StringView view, size_t index, ClusterIndex* cache = NULL);
+
+  /* Get the byte offset where the extended grapheme cluster containing a byte offset of a StringView starts
+   * (Moving a cursor back is cluster_start(view, cursor - 1), byte_length is returned as it is) */
+  extern size_t cluster_start (StringView view, size_t byte_offset, ClusterIndex* cache = NULL);
+
+
+  /* Read only contents of a file, memory mapped when possible so loading it copies nothing and pages come in as they are read
+   * (Pipes and other inputs that can't be mapped are read into a heap buffer a chunk at a time instead) */
+  struct MappedFile {
+    uint8_t const* bytes = NULL;
+    size_t byte_length = 0;
+    bool is_mapped = false; // Whether bytes is a mapping rather than a heap buffer
+
+    /* Create an empty MappedFile */
+    MappedFile () = default;
+
+    /* Create a MappedFile by taking the contents of another, which is left empty */
+    MappedFile (MappedFile&& src) noexcept
+    { move(src); }
+
+    MappedFile (MappedFile const&) = delete;
+    MappedFile& operator = (MappedFile const&) = delete;
+
+    /* Replace a MappedFile with the contents of another, which is left empty (Wrapper for move) */
+    MappedFile& operator = (MappedFile&& src) noexcept {
+      move(src);
+      return *this;
+    }
+
+    /* Wraps dispose for automatic clean up when going out of scope */
+    ~MappedFile () {
+      dispose();
+    }
+
+    /* Get a StringView of the contents of a MappedFile (Not NUL terminated) */
+    StringView view () const {
+      return { bytes, byte_length };
+    }
+
+    /* Load a file by name, mapping it if possible */
+    static MappedFile from_file (char const* file_name);
+
+    /* Load the whole file behind an open stream, mapping it if possible (A mapping covers the file from its start wherever the stream is,
+     * reads start at the current position) */
+    static MappedFile from_stream (FILE* f);
+
+    /* Unmap or free the contents of a MappedFile and zero initialize it again */
+    void dispose ();
+
+    /* Move a MappedFile's contents into another MappedFile, freeing what it held before */
+    void move (MappedFile& source);
+  };
+
+
+  /* Outcome of a Reader call */
+  enum class ReadStatus : uint8_t {
+    Ok,
+    End, // The input has been read completely
+    Truncated, // The input ends in the middle of a sequence
+    Malformed, // A grapheme or chunk ran into malformed utf8 (Details are in the Reader's error)
+    IoError, // Reading from the stream failed
+  };
+
+
+  /* Buffered reader handing out graphemes, lines or validated chunks of a utf8 stream, carrying sequences split between reads over
+   * to the next block (Views it hands out are only valid until the next call) */
+  struct Reader {
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    FILE* file = NULL;
+    uint8_t* buffer = NULL;
+    size_t capacity = 0;
+    size_t start = 0; // First byte of buffer not handed out yet
+    size_t end = 0; // End of the bytes read into buffer
+    size_t position = 0; // Offset in the stream of buffer[start]
+    bool eof = false;
+    bool failed = false;
+
+    /* Last malformed sequence found by read_char or read_chunk, its offset counted from the start of the stream */
+    ValidationResult error = { };
+
+    /* Create a Reader over an open stream, which it does not close */
+    Reader (FILE* in_file, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    Reader (Reader const&) = delete;
+    Reader& operator = (Reader const&) = delete;
+
+    /* Wraps dispose for automatic clean up when going out of scope */
+    ~Reader () {
+      dispose();
+    }
+
+    /* Read a single utf32 grapheme (A malformed sequence reads as U+FFFD with ReadStatus::Malformed and its first byte skipped,
+     * and one cut off by the end of input as U+FFFD with ReadStatus::Truncated, both setting error) */
+    ReadStatus read_char (int32_t& c);
+
+    /* Read up to the next '\n', which is left out along with a '\r' before it (The buffer grows to fit long lines,
+     * and a last line with no '\n' is still read) */
+    ReadStatus read_line (StringView& line);
+
+    /* Read as many whole, validated sequences as the buffer holds (On ReadStatus::Malformed or Truncated chunk is the valid part
+     * before the error, and the offending byte is skipped so reading can carry on) */
+    ReadStatus read_chunk (StringView& chunk);
+
+    /* Free the buffer of a Reader and zero initialize it again */
+    void dispose ();
+  };
+
+
+  /* Buffered writer encoding graphemes straight into its own buffer and handing it to the stream in large blocks
+   * (Once a write fails every later call returns false) */
+  struct Writer {
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    FILE* file = NULL;
+    uint8_t* buffer = NULL;
+    size_t capacity = 0;
+    size_t length = 0; // Bytes in buffer waiting to be written
+    bool failed = false;
+
+    /* Create a Writer over an open stream, which it does not close */
+    Writer (FILE* in_file, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    Writer (Writer const&) = delete;
+    Writer& operator = (Writer const&) = delete;
+
+    /* Wraps dispose for automatic clean up when going out of scope (Call flush first to find out whether the last block was written) */
+    ~Writer () {
+      dispose();
+    }
+
+    /* Add a single utf32 grapheme as utf8 */
+    bool put_char (int32_t c);
+
+    /* Add the bytes of a StringView (Spans bigger than the buffer go to the stream along with the buffer in a single write) */
+    bool write (StringView src);
+
+    /* Add the bytes of a String */
+    bool write (String const& src) {
+      return write(StringView { src });
+    }
+
+    /* Add a ustr */
+    bool write (uint8_t const* ustr) {
+      return write(StringView { ustr });
+    }
+
+    /* Add a str */
+    bool write (char const* str) {
+      return write(StringView { str });
+    }
+
+    /* Add a series of utf32 graphemes as utf8, encoding them a buffer's worth at a time */
+    bool write (int32_t const* utf32, size_t count);
+
+    /* Write everything buffered to the stream and flush that too */
+    bool flush ();
+
+    /* Flush a Writer, free its buffer and zero initialize it again */
+    void dispose ();
+  };
+
+
+  /* A node of a Rope, holding one chunk of utf8 plus the counts of its subtree */
+  struct RopeNode;
+
+  struct Rope;
+
+
+  /* Index + value pair iterator for Rope (Looks up the next chunk from the root when it steps off the end of one) */
+  struct RopeIterator {
+    size_t index = 0;
+    Rope const* rope = NULL;
+    RopeNode const* node = NULL;
+    size_t offset = 0; // Byte offset in the chunk of node
+
+    StringIteratorResult operator * () const;
+
+    RopeIterator& operator ++ ();
+
+    bool operator != (RopeIterator const& other) const;
+  };
+
+
+  /* Balanced tree of utf8 chunks for large text edited in the middle, caching grapheme, byte and newline counts per node
+   * so that indexed access, insert_at and remove are O(log n) (Expects well formed utf8) */
+  struct Rope {
+    /* Most bytes a single chunk of a Rope holds, edits that fit inside one chunk don't restructure the tree */
+    static constexpr size_t CHUNK_CAPACITY = 512;
+
+    RopeNode* root = NULL;
+
+    /* State of the generator for node priorities, which keep the tree balanced */
+    uint32_t seed = 0x9E3779B9;
+
+    /* Create an empty Rope */
+    Rope () = default;
+
+    /* Create a Rope from a StringView */
+    Rope (StringView src)
+    { insert(src); }
+
+    /* Create a Rope from a ustr */
+    Rope (uint8_t const* src)
+    : Rope(StringView { src })
+    { }
+
+    /* Create a Rope from a str */
+    Rope (char const* src)
+    : Rope(StringView { src })
+    { }
+
+    /* Create a Rope from a String */
+    Rope (String const& src)
+    : Rope(StringView { src })
+    { }
+
+    /* Create a Rope by taking the tree of another, which is left empty */
+    Rope (Rope&& src) noexcept
+    { move(src); }
+
+    Rope (Rope const&) = delete;
+    Rope& operator = (Rope const&) = delete;
+
+    /* Replace a Rope with the tree of another, which is left empty (Wrapper for move) */
+    Rope& operator = (Rope&& src) noexcept {
+      move(src);
+      return *this;
+    }
+
+    /* Wraps dispose for automatic clean up when going out of scope */
+    ~Rope () {
+      dispose();
+    }
+
+    /* Create a RopeIterator representing the start of the Rope */
+    RopeIterator begin () const;
+
+    /* Create a RopeIterator representing the end of the Rope */
+    RopeIterator end () const;
+
+    /* Get the grapheme at an index in a Rope (Wrapper for char_at) */
+    int32_t operator [] (size_t index) const {
+      return char_at(index);
+    }
+
+    /* Get the length of a Rope in graphemes */
+    size_t length () const;
+
+    /* Get the length of a Rope in bytes */
+    size_t byte_length () const;
+
+    /* Get the number of '\n' bytes in a Rope */
+    size_t newline_count () const;
+
+    /* Get the grapheme at an index in a Rope (0 if the index is past the end) */
+    int32_t char_at (size_t index) const;
+
+    /* Get the grapheme index a line starts at, counting lines from 0 (The length of the Rope if there are not that many lines) */
+    size_t line_start (size_t line) const;
+
+
+    /* Append a StringView to a Rope */
+    void insert (StringView src) {
+      insert_at(SIZE_MAX, src);
+    }
+
+    /* Append a single utf32 grapheme to a Rope */
+    void insert (int32_t c);
+
+    /* Insert a StringView into a Rope at a grapheme index (Past the end appends) */
+    void insert_at (size_t index, StringView src);
+
+    /* Insert a single utf32 grapheme into a Rope at a grapheme index (Past the end appends) */
+    void insert_at (size_t index, int32_t c);
+
+    /* Remove a number of graphemes from a Rope starting at an index (Clamped to the end) */
+    void remove (size_t index, size_t count = 1);
+
+
+    /* Create a String with the contents of a Rope */
+    String to_string () const;
+
+    /* Create a new copy of a Rope with all known graphemes converted to their lowercase equivalent */
+    Rope to_lowercase () const;
+
+    /* Create a new copy of a Rope with all known graphemes converted to their uppercase equivalent */
+    Rope to_uppercase () const;
+
+
+    /* Free all the chunks of a Rope and zero initialize it again */
+    void dispose ();
+
+    /* Move a Rope's tree into another Rope, freeing what it held before */
+    void move (Rope& source);
   };
 }